@@ -0,0 +1,243 @@
+// Buddy allocator for physically contiguous runs of pages.
+//
+// Free memory is kept as blocks of 2^k pages, 0 <= k <= MAXORDER,
+// each aligned to its own size. Allocating a block of order k
+// splits a larger free block if there is none of order k;
+// freeing a block merges it with its buddy (the other half of
+// the block of order k+1 it was split from) whenever the
+// buddy is free too.
+//
+// kalloc() and kfree() sit on top of this, caching single
+// pages per CPU; see kalloc.c.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+// bd_state[] entry for the first page of a free block
+// holds BD_FREE | the block's order. every other entry,
+// including those of allocated pages, is 0.
+#define BD_FREE 0x80
+
+#define BLKSIZE(k) ((uint64)PGSIZE << (k))
+
+// a free block; lives in the block's first page.
+struct bd_block {
+  struct bd_block *next;
+  struct bd_block *prev;
+};
+
+struct {
+  struct spinlock lock;
+  struct bd_block freelist[MAXORDER+1]; // circular, one per order
+  uint64 nblock[MAXORDER+1];            // free blocks of each order
+  uint64 nfail[MAXORDER+1];             // failed allocations of each order
+  uint64 npage;                         // free pages in all blocks
+} bd;
+
+static uchar bd_state[NPHYSPAGE];
+
+static void
+lst_push(struct bd_block *l, struct bd_block *b)
+{
+  b->next = l->next;
+  b->prev = l;
+  l->next->prev = b;
+  l->next = b;
+}
+
+static void
+lst_remove(struct bd_block *b)
+{
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+}
+
+static int
+lst_empty(struct bd_block *l)
+{
+  return l->next == l;
+}
+
+// Put the block at pa on the free list for order k.
+// Caller must hold bd.lock.
+static void
+bd_insert(uint64 pa, int k)
+{
+  bd_state[PA2PGIDX(pa)] = BD_FREE | k;
+  lst_push(&bd.freelist[k], (struct bd_block*)pa);
+  bd.nblock[k]++;
+}
+
+// Take the free block at pa off the free list for order k.
+// Caller must hold bd.lock.
+static void
+bd_unlink(uint64 pa, int k)
+{
+  bd_state[PA2PGIDX(pa)] = 0;
+  lst_remove((struct bd_block*)pa);
+  bd.nblock[k]--;
+}
+
+static void*
+bd_alloc_locked(int order)
+{
+  uint64 pa;
+  int k;
+
+  for(k = order; k <= MAXORDER; k++)
+    if(!lst_empty(&bd.freelist[k]))
+      break;
+  if(k > MAXORDER){
+    bd.nfail[order]++;
+    return 0;
+  }
+
+  pa = (uint64)bd.freelist[k].next;
+  bd_unlink(pa, k);
+
+  // give back the upper half until the block is the right size.
+  while(k > order){
+    k--;
+    bd_insert(pa + BLKSIZE(k), k);
+  }
+  bd.npage -= 1L << order;
+  return (void*)pa;
+}
+
+static void
+bd_free_locked(void *p, int order)
+{
+  uint64 idx = PA2PGIDX(p);
+  uint64 buddy;
+
+  bd.npage += 1L << order;
+  for(; order < MAXORDER; order++){
+    buddy = idx ^ (1L << order);
+    if(buddy >= NPHYSPAGE || bd_state[buddy] != (BD_FREE | order))
+      break;
+    bd_unlink(KERNBASE + buddy*PGSIZE, order);
+    idx &= ~(1L << order);
+  }
+  bd_insert(KERNBASE + idx*PGSIZE, order);
+}
+
+// Hand the memory in [start, end) to the allocator, as
+// the largest aligned blocks that fit.
+void
+bd_init(void *start, void *end)
+{
+  uint64 pa = PGROUNDUP((uint64)start);
+  int k;
+
+  initlock(&bd.lock, "buddy");
+  for(k = 0; k <= MAXORDER; k++){
+    bd.freelist[k].next = &bd.freelist[k];
+    bd.freelist[k].prev = &bd.freelist[k];
+  }
+
+  while(pa + PGSIZE <= (uint64)end){
+    for(k = MAXORDER; k > 0; k--)
+      if(PA2PGIDX(pa) % (1L << k) == 0 && pa + BLKSIZE(k) <= (uint64)end)
+        break;
+    bd_insert(pa, k);
+    bd.npage += 1L << k;
+    pa += BLKSIZE(k);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size. Returns 0 if no block is big enough.
+void*
+bd_alloc(int order)
+{
+  void *p;
+
+  if(order < 0 || order > MAXORDER)
+    panic("bd_alloc");
+  acquire(&bd.lock);
+  p = bd_alloc_locked(order);
+  release(&bd.lock);
+  return p;
+}
+
+// Free a block that bd_alloc(order) returned.
+void
+bd_free(void *p, int order)
+{
+  if(order < 0 || order > MAXORDER ||
+     (uint64)p % BLKSIZE(order) != 0 || (uint64)p < KERNBASE ||
+     (uint64)p + BLKSIZE(order) > PHYSTOP)
+    panic("bd_free");
+  acquire(&bd.lock);
+  bd_free_locked(p, order);
+  release(&bd.lock);
+}
+
+// Allocate up to n single pages, taking the lock only once.
+// The pages are returned in *list, linked through their
+// first word. Returns the number of pages allocated.
+int
+bd_allocn(int n, void **list)
+{
+  void *p;
+  int i;
+
+  *list = 0;
+  acquire(&bd.lock);
+  for(i = 0; i < n; i++){
+    if((p = bd_alloc_locked(0)) == 0)
+      break;
+    *(void**)p = *list;
+    *list = p;
+  }
+  release(&bd.lock);
+  return i;
+}
+
+// Free a list of single pages linked through their
+// first word, as built by bd_allocn().
+void
+bd_freen(void *list)
+{
+  void *next;
+
+  acquire(&bd.lock);
+  for(; list; list = next){
+    next = *(void**)list;
+    bd_free_locked(list, 0);
+  }
+  release(&bd.lock);
+}
+
+// Return the number of free pages held by the allocator.
+uint64
+bd_nfree(void)
+{
+  return bd.npage;
+}
+
+// Print the free blocks of each order, and how much of
+// free memory is too fragmented to satisfy a request of
+// that order (the unusable free space index).
+// No lock to avoid wedging a stuck machine further.
+void
+bd_dump(void)
+{
+  uint64 usable = 0;
+  int k;
+
+  printf("buddy: %d free pages\n", (int)bd.npage);
+  for(k = MAXORDER; k >= 0; k--){
+    usable += bd.nblock[k] << k;
+    if(bd.nblock[k] == 0 && bd.nfail[k] == 0)
+      continue;
+    printf("  order %d: %d free, %d%% unusable, %d failed\n", k,
+           (int)bd.nblock[k],
+           bd.npage ? (int)((bd.npage - usable) * 100 / bd.npage) : 0,
+           (int)bd.nfail[k]);
+  }
+}
@@ -140,8 +140,10 @@ consoleintr(int c)
   acquire(&cons.lock);
 
   switch(c){
-  case C('P'):  // Print process list.
+  case C('P'):  // Print process list and memory statistics.
     procdump();
+    kmemdump();
+    kvmdump();
     break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
@@ -1,13 +1,17 @@
 struct buf;
 struct context;
+struct fdtable;
 struct file;
 struct inode;
+struct kallocsite;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct sysinfo;
 
 // bio.c
 void            binit(void);
@@ -17,6 +21,15 @@ void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
+// buddy.c
+void            bd_init(void*, void*);
+void*           bd_alloc(int);
+void            bd_free(void*, int);
+int             bd_allocn(int, void**);
+void            bd_freen(void*);
+uint64          bd_nfree(void);
+void            bd_dump(void);
+
 // console.c
 void            consoleinit(void);
 void            consoleintr(int);
@@ -24,11 +37,22 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             segbacked(struct proc*, uint64);
+int             segload(struct proc*, uint64);
+void            segclip(struct proc*, uint64);
+char*           textpage(struct inode*, uint64);
+void            textfree(struct inode*);
+int             texttrim(struct inode*);
 
 // file.c
 struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
+struct fdtable* fdtalloc(void);
+struct fdtable* fdtcopy(struct fdtable*);
+struct fdtable* fdtdup(struct fdtable*);
+void            fdtclose(struct fdtable*);
+struct inode*   fdtcwd(struct fdtable*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
@@ -43,6 +67,7 @@ struct inode*   idup(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
+int             itextreap(void);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
@@ -61,9 +86,21 @@ void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzerofill(void);
 void            kfree(void *);
+void            kdup(void *);
+int             krefcnt(void *);
+void*           kzeropage(void);
 void            kinit(void);
+void*           kallocpages(int);
+void            kfreepages(void*, int);
 uint64          knfreemem();
+int             kreserve(uint64);
+void            kunreserve(uint64);
+void            kmeminfo(struct sysinfo*);
+int             kallocsites(int, struct kallocsite*, int);
+void            kmemdump(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,7 +108,18 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, struct file*, uint64);
+int             munmap(uint64, uint64);
+uint64          mmapbase(struct proc*);
+int             mmapbacked(struct proc*, uint64);
+int             mmapfault(struct proc*, uint64, int);
+void            mmapclear(struct proc*);
+int             mmappopulate(struct proc*);
+int             mmapfork(struct proc*, struct proc*);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -86,7 +134,7 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
-int             growproc(int);
+uint64          growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
@@ -97,9 +145,17 @@ void            procinit(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            setproc(struct proc*);
+void            setrunnable(struct proc*);
+int             procreap(void);
+int             timeslice(void);
+void            boost(void);
+int             nice(int);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
+int             clone(uint64, uint64, uint64);
+int             join(int, uint64);
+int             waitpid(int, uint64, int);
 void            wakeup(void*);
 void            yield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
@@ -110,6 +166,10 @@ uint64             getnfreeproc(void);
 // swtch.S
 void            swtch(struct context*, struct context*);
 
+// ucopy.S
+int             ucopy(char*, char*, uint64);
+int             ucopystr(char*, char*, uint64);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -118,6 +178,13 @@ void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
 
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             kmem_reap(void);
+void            kmem_cache_dump(void);
+
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
@@ -133,6 +200,14 @@ int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
 
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swapout(uint64);
+int             swapin(struct proc*, pte_t*);
+void            swapdup(pte_t);
+void            swapfree(pte_t);
+void            swapdump(void);
+
 // syscall.c
 int             argint(int, int*);
 int             argstr(int, char*, int);
@@ -147,6 +222,16 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+uint64          mtime(void);
+void            timeridle(void);
+void            timerresume(void);
+void            kick(int);
+
+// timer.c
+void            wheelinit(void);
+void            wheelarm(uint64);
+int             sleepuntil(uint64);
+void            wheelexpire(void);
 
 // uart.c
 void            uartinit(void);
@@ -158,9 +243,19 @@ int             uartgetc(void);
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+pagetable_t     kvmcreate(pagetable_t);
+void            kvmsetuser(pagetable_t, pagetable_t);
+void            kvmswitch(struct proc*);
+void            tlbpoll(void);
+void            uvmflush(pagetable_t, uint64);
+void            uvmflushall(pagetable_t);
+void            kvmdump(void);
 uint64          kvmpa(uint64);
 void            kvmmap(uint64, uint64, uint64, int);
+int             kvmalloc(uint64);
+void            kvmfree(uint64);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+pte_t*          walk(pagetable_t, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
@@ -170,6 +265,9 @@ void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+int             uvmfault(pagetable_t, uint64, int);
+int             uvmfill(struct proc*, uint64, uint64, int);
+void            uvmprefault(pagetable_t, uint64, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
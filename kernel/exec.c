@@ -6,21 +6,62 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+// exec() doesn't read the program's segments into memory.
+// it only records where they are in the file, and reserves
+// memory for them; the pages are read in by uvmfault() when
+// the program first touches them. the process holds on to
+// its executable's inode for this.
+//
+// whole pages read from a program file are kept with the
+// file's inode, so that every process running the program
+// maps the same physical page: read-only, or copy-on-write
+// if the segment is writable. the cache holds a reference
+// to each page, and is dropped when the last process
+// running the program lets go of the inode, or when the
+// file is written.
+
+struct textent {
+  uint64 off;         // offset of the page in the file
+  char *pa;
+};
+
+#define NTEXTENT (PGSIZE / sizeof(struct textent))
+
+static int
+flags2perm(int flags)
+{
+  int perm = PTE_R | PTE_U;
+
+  if(flags & ELF_PROG_FLAG_EXEC)
+    perm |= PTE_X;
+  if(flags & ELF_PROG_FLAG_WRITE)
+    perm |= PTE_W;
+  return perm;
+}
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
   int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase;
+  uint64 argc, sz = 0, sp, ustack[MAXARG+1], stackbase, npages;
   struct elfhdr elf;
-  struct inode *ip;
+  struct inode *ip, *exe = 0, *oldexe;
   struct proghdr ph;
+  struct seg seg[NSEG];
+  int nseg = 0;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  // the other threads would be left running in
+  // the old image; see clone().
+  if(p->nthread != 1)
+    return -1;
+
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -38,7 +79,7 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Record the program's segments, and reserve memory for them.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -46,32 +87,53 @@ exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz >= MMAPTOP)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
-      goto bad;
-    sz = sz1;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size)
+      goto bad;
+    if(nseg >= NSEG)
       goto bad;
+    if(ph.vaddr + ph.memsz > sz){
+      npages = (PGROUNDUP(ph.vaddr + ph.memsz) - PGROUNDUP(sz)) / PGSIZE;
+      if(kreserve(npages) < 0)
+        goto bad;
+      sz = ph.vaddr + ph.memsz;
+    }
+    seg[nseg].va = ph.vaddr;
+    seg[nseg].filesz = ph.filesz;
+    seg[nseg].off = ph.off;
+    seg[nseg].perm = flags2perm(ph.flags);
+    nseg++;
   }
-  iunlockput(ip);
+  iunlock(ip);
   end_op();
+  exe = ip;
   ip = 0;
 
   p = myproc();
   uint64 oldsz = p->sz;
 
-  // Allocate two pages at the next page boundary.
-  // Use the second as the user stack.
+  // Allocate a guard page at the next page boundary, and
+  // above it room for USTACKSIZE pages of user stack. Only
+  // the top page of the stack is allocated now; the rest
+  // are reserved, for uvmfault() to fill in as the stack
+  // grows down.
   sz = PGROUNDUP(sz);
+  if(sz + (1+USTACKSIZE)*PGSIZE > MMAPTOP)
+    goto bad;
   uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
+  if((sz1 = uvmalloc(pagetable, sz, sz + PGSIZE)) == 0)
+    goto bad;
+  uvmclear(pagetable, sz);
+  sz = sz1;
+  if(kreserve(USTACKSIZE-1) < 0)
+    goto bad;
+  sz += (USTACKSIZE-1)*PGSIZE;
+  if((sz1 = uvmalloc(pagetable, sz, sz + PGSIZE)) == 0)
     goto bad;
   sz = sz1;
-  uvmclear(pagetable, sz-2*PGSIZE);
   sp = sz;
   stackbase = sp - PGSIZE;
 
@@ -109,12 +171,24 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  mmapclear(p);
   oldpagetable = p->pagetable;
+  oldexe = p->exe;
   p->pagetable = pagetable;
+  kvmsetuser(p->kpagetable, pagetable);
+  uvmflushall(pagetable);
   p->sz = sz;
+  p->exe = exe;
+  memmove(p->seg, seg, sizeof(seg));
+  p->nseg = nseg;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
   proc_freepagetable(oldpagetable, oldsz);
+  if(oldexe){
+    begin_op();
+    iput(oldexe);
+    end_op();
+  }
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
@@ -125,33 +199,163 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  if(exe){
+    begin_op();
+    iput(exe);
+    end_op();
+  }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+// Return 1 if the page at va is at least partly
+// read from p's executable, 0 if not.
+int
+segbacked(struct proc *p, uint64 va)
+{
+  struct seg *s;
+
+  va = PGROUNDDOWN(va);
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->filesz)
+      return 1;
+  return 0;
+}
+
+// Return the page at offset off of ip, shared through ip's
+// cache, with a reference added for the caller.
+// Caller must hold ip->lock.
+// Returns 0 if the page can't be read or cached.
+char*
+textpage(struct inode *ip, uint64 off)
+{
+  struct textent *e;
+  char *pa;
+
+  if(ip->text == 0 && (ip->text = kalloc_zeroed()) == 0)
+    return 0;
+  for(e = ip->text; e < &ip->text[NTEXTENT] && e->pa; e++){
+    if(e->off == off){
+      kdup(e->pa);
+      return e->pa;
+    }
+  }
+  if(e == &ip->text[NTEXTENT] || (pa = kalloc()) == 0)
+    return 0;
+  if(readi(ip, 0, (uint64)pa, off, PGSIZE) != PGSIZE){
+    kfree(pa);
+    return 0;
+  }
+  e->off = off;
+  e->pa = pa;
+  kdup(pa);
+  return pa;
+}
+
+// Drop ip's cache of program pages. Processes that
+// have the pages mapped keep their own references.
+// Caller must hold ip->lock, or the only reference to ip.
+void
+textfree(struct inode *ip)
+{
+  struct textent *e;
+
+  for(e = ip->text; e < &ip->text[NTEXTENT] && e->pa; e++)
+    kfree(e->pa);
+  kfree(ip->text);
+  ip->text = 0;
+}
+
+// Free the pages in ip's cache that no process maps.
+// Caller must hold ip->lock.
+// Returns the number of pages freed.
+int
+texttrim(struct inode *ip)
 {
-  uint i, n;
-  uint64 pa;
-
-  if((va % PGSIZE) != 0)
-    panic("loadseg: va must be page aligned");
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
+  struct textent *e, *keep;
+  int freed = 0;
+
+  if(ip->text == 0)
+    return 0;
+  keep = ip->text;
+  for(e = ip->text; e < &ip->text[NTEXTENT] && e->pa; e++){
+    if(krefcnt(e->pa) == 1){
+      kfree(e->pa);
+      freed++;
+    } else {
+      *keep++ = *e;
+    }
+  }
+  for(; keep < e; keep++)
+    keep->pa = 0;
+  if(ip->text[0].pa == 0){
+    kfree(ip->text);
+    ip->text = 0;
+    freed++;
+  }
+  return freed;
+}
+
+// Map the page at va, which must lie in one of p's segments,
+// reading it from p's executable. Whole pages of the file are
+// shared with other processes running it. p is a leader; the
+// page may have been mapped by another of its threads, or freed
+// by sbrk(), while the file was read. May sleep.
+// Returns 0 on success, -1 if the file can't be read
+// or there's no memory.
+int
+segload(struct proc *p, uint64 va)
+{
+  struct seg *s;
+  uint64 off, n;
+  char *mem = 0;
+  int perm, r;
+
+  va = PGROUNDDOWN(va);
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->filesz)
+      break;
+  if(s == &p->seg[p->nseg])
+    panic("segload");
+  off = s->off + (va - s->va);
+  n = s->va + s->filesz - va;
+  perm = s->perm;
+
+  ilock(p->exe);
+  if(n >= PGSIZE && (mem = textpage(p->exe, off)) != 0){
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  } else if((mem = kalloc_zeroed()) != 0){
+    if(n > PGSIZE)
       n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
+    if(readi(p->exe, 0, (uint64)mem, off, n) != n){
+      kfree(mem);
+      mem = 0;
+    }
   }
-  
+  iunlock(p->exe);
+  if(mem == 0)
+    return -1;
+
+  if((r = uvmfill(p, va, (uint64)mem, perm)) != 0){
+    kfree(mem);
+    return r < 0 ? -1 : 0;
+  }
+  kunreserve(1);
   return 0;
 }
+
+// Forget the parts of p's segments at or above va, which
+// must be page-aligned, after sbrk() has shrunk p below va,
+// so that the memory reads as zeros if p grows again.
+void
+segclip(struct proc *p, uint64 va)
+{
+  struct seg *s;
+
+  for(s = p->seg; s < &p->seg[p->nseg]; s++){
+    if(s->va >= va)
+      s->filesz = 0;
+    else if(s->va + s->filesz > va)
+      s->filesz = va - s->va;
+  }
+}
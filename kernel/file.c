@@ -12,17 +12,102 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
 struct {
-  struct spinlock lock;
-  struct file file[NFILE];
+  struct spinlock lock;   // protects every file's ref
+  struct kmem_cache cache;
+  struct kmem_cache tcache; // for struct fdtable
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&ftable.cache, "file", sizeof(struct file));
+  kmem_cache_init(&ftable.tcache, "fdtable", sizeof(struct fdtable));
+}
+
+// Allocate an empty descriptor table, with no current
+// directory yet.
+struct fdtable*
+fdtalloc(void)
+{
+  struct fdtable *t;
+
+  if((t = kmem_cache_alloc(&ftable.tcache)) == 0)
+    return 0;
+  memset(t, 0, sizeof(*t));
+  initlock(&t->lock, "fdtable");
+  t->ref = 1;
+  return t;
+}
+
+// Make a copy of descriptor table t, for fork().
+struct fdtable*
+fdtcopy(struct fdtable *t)
+{
+  struct fdtable *nt;
+  int fd;
+
+  if((nt = fdtalloc()) == 0)
+    return 0;
+  acquire(&t->lock);
+  for(fd = 0; fd < NOFILE; fd++)
+    if(t->ofile[fd])
+      nt->ofile[fd] = filedup(t->ofile[fd]);
+  nt->cwd = idup(t->cwd);
+  release(&t->lock);
+  return nt;
+}
+
+// Share descriptor table t with another thread, for clone().
+struct fdtable*
+fdtdup(struct fdtable *t)
+{
+  acquire(&t->lock);
+  t->ref++;
+  release(&t->lock);
+  return t;
+}
+
+// Drop a thread's use of descriptor table t, closing
+// its files when the last thread is done with it.
+void
+fdtclose(struct fdtable *t)
+{
+  int fd;
+
+  acquire(&t->lock);
+  if(--t->ref > 0){
+    release(&t->lock);
+    return;
+  }
+  release(&t->lock);
+
+  for(fd = 0; fd < NOFILE; fd++)
+    if(t->ofile[fd])
+      fileclose(t->ofile[fd]);
+  if(t->cwd){
+    begin_op();
+    iput(t->cwd);
+    end_op();
+  }
+  kmem_cache_free(&ftable.tcache, t);
+}
+
+// Return descriptor table t's current directory,
+// with a reference the caller must iput().
+struct inode*
+fdtcwd(struct fdtable *t)
+{
+  struct inode *ip;
+
+  acquire(&t->lock);
+  ip = idup(t->cwd);
+  release(&t->lock);
+  return ip;
 }
 
 // Allocate a file structure.
@@ -31,16 +116,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +149,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -111,6 +190,9 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // pipes and devices copy out with a spinlock held.
+  uvmprefault(myproc()->pagetable, addr, n);
+
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -139,6 +221,9 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  // pipes and devices copy in with a spinlock held.
+  uvmprefault(myproc()->pagetable, addr, n);
+
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -27,6 +27,7 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+1];
+  struct textent *text; // pages shared by programs run from this file; see exec.c
 };
 
 // map major device number to device functions.
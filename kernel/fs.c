@@ -44,6 +44,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  swapinit(dev, &sb);
 }
 
 // Zero a block.
@@ -353,10 +354,42 @@ iput(struct inode *ip)
     acquire(&icache.lock);
   }
 
+  // ip->ref == 1 means no process is running this file
+  // any more, so the pages exec() cached can go.
+  if(ip->ref == 1 && ip->text)
+    textfree(ip);
+
   ip->ref--;
   release(&icache.lock);
 }
 
+// Free the program pages that inodes cache for exec()
+// but that no process maps any more. Called when memory
+// is short. Returns the number of pages freed.
+int
+itextreap(void)
+{
+  struct inode *ip;
+  int freed = 0;
+
+  begin_op();
+  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
+    acquire(&icache.lock);
+    if(ip->ref == 0 || ip->text == 0){
+      release(&icache.lock);
+      continue;
+    }
+    ip->ref++;
+    release(&icache.lock);
+
+    ilock(ip);
+    freed += texttrim(ip);
+    iunlockput(ip);
+  }
+  end_op();
+  return freed;
+}
+
 // Common idiom: unlock, then put.
 void
 iunlockput(struct inode *ip)
@@ -413,6 +446,9 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->text)
+    textfree(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -490,6 +526,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  // programs started from now on must see the new contents.
+  if(ip->text)
+    textfree(ip);
+
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
@@ -630,7 +670,7 @@ namex(char *path, int nameiparent, char *name)
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = fdtcwd(myproc()->fdt);
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
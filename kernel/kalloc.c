@@ -1,6 +1,26 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Pages come from the buddy allocator (buddy.c). Each CPU
+// caches a list of single free pages, so that kalloc() and
+// kfree() on different harts don't contend for one lock.
+// A CPU whose list runs dry refills it with a batch from the
+// buddy allocator, or failing that steals a batch from the
+// other CPUs' lists; a CPU whose list grows too long gives a
+// batch back, so that the pages can coalesce.
+//
+// Idle CPUs also zero free pages ahead of time into a pool,
+// from which kalloc_zeroed() takes pages that are about to
+// be zeroed anyway, such as page-table pages and user memory.
+//
+// Read faults on untouched user memory map one shared page of
+// zeros, rather than a page each; see kzeropage().
+//
+// Building with -DKALLOC_POISON fills allocated and freed
+// pages with junk, to catch uses of uninitialized memory
+// and dangling references. Building with -DKALLOC_TRACE
+// records who allocated each page, for kallocsites().
 
 #include "types.h"
 #include "param.h"
@@ -8,8 +28,17 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "proc.h"
+#include "sysinfo.h"
 
-void freerange(void *pa_start, void *pa_end);
+// how many pages a CPU moves at once between its free
+// list and the buddy allocator or another CPU's list.
+#define NBATCH 32
+
+// how many pre-zeroed pages to keep, and how many an
+// idle CPU zeroes before checking for work again.
+#define NZPOOL 256
+#define NZFILL 8
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
@@ -18,48 +47,267 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  uint64 nfree;         // number of pages on freelist
+};
+
+struct kmem kmem[NCPU];
+
+// pool of free pages that are already zeroed.
+struct {
+  struct spinlock lock;
+  struct run *list;
+  uint64 n;
+} zpool;
+
+// reference counts of pages handed out by kalloc(), so that
+// copy-on-write fork can map one page into several address
+// spaces. kfree() only frees a page when its count drops to 0.
+static int pgref[NPHYSPAGE];
+
+// the shared page of zeros. its reference count is one more
+// than the number of mappings, so it is never freed.
+static char *zeropage;
+
+#ifdef KALLOC_TRACE
+// who holds each allocated page. written without a lock,
+// since only the page's allocator touches its entry.
+static struct {
+  uint64 pc;            // where kalloc() was called from, or 0 if free
+  int pid;              // process that called it, or 0
+} owner[NPHYSPAGE];
+
+// Record that npages pages at pa were allocated from pc.
+static void
+setowner(void *pa, int npages, uint64 pc)
+{
+  struct proc *p = myproc();
+  int i;
+
+  for(i = 0; i < npages; i++){
+    owner[PA2PGIDX(pa) + i].pc = pc;
+    owner[PA2PGIDX(pa) + i].pid = p ? p->pid : 0;
+  }
+}
+#else
+#define setowner(pa, npages, pc)
+#endif
+
+// allocator statistics for sysinfo(). updated with
+// atomic instructions rather than under a lock, so
+// that reading them never holds up kalloc().
+struct {
+  uint64 nalloc;        // pages currently allocated
+  uint64 peak;          // high-water mark of nalloc
+  uint64 nfail;         // kalloc() calls that returned 0
+  uint64 nresv;         // pages promised by kreserve()
+} kstat;
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
-  freerange(end, (void*)PHYSTOP);
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&zpool.lock, "zpool");
+  bd_init(end, (void*)PHYSTOP);
+  if((zeropage = kalloc_zeroed()) == 0)
+    panic("kinit: zeropage");
 }
 
-void
-freerange(void *pa_start, void *pa_end)
+static void
+countalloc(int npages)
+{
+  uint64 n = __sync_add_and_fetch(&kstat.nalloc, npages);
+  uint64 peak = kstat.peak;
+  while(n > peak){
+    uint64 old = __sync_val_compare_and_swap(&kstat.peak, peak, n);
+    if(old == peak)
+      break;
+    peak = old;
+  }
+}
+
+// Remove up to n pages from the front of km's free list
+// and return them. Caller must hold km->lock.
+static struct run*
+detach(struct kmem *km, int n)
+{
+  struct run *first, *last;
+  int i;
+
+  first = last = km->freelist;
+  if(first == 0)
+    return 0;
+  for(i = 1; i < n && last->next; i++)
+    last = last->next;
+  km->freelist = last->next;
+  km->nfree -= i;
+  last->next = 0;
+  return first;
+}
+
+// Add a list of n pages to the front of km's free list.
+// Caller must hold km->lock.
+static void
+attach(struct kmem *km, struct run *list, int n)
 {
-  char *p;
-  p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  struct run *last;
+
+  for(last = list; last->next; last = last->next)
+    ;
+  last->next = km->freelist;
+  km->freelist = list;
+  km->nfree += n;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last one.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *spill = 0;
+  struct kmem *km;
+  int ref;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  ref = __sync_sub_and_fetch(&pgref[PA2PGIDX(pa)], 1);
+  if(ref > 0)
+    return;
+  if(ref < 0)
+    panic("kfree: ref");
+  setowner(pa, 1, 0);
+
+#ifdef KALLOC_POISON
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  km = &kmem[cpuid()];
+  acquire(&km->lock);
+  r->next = km->freelist;
+  km->freelist = r;
+  km->nfree++;
+  if(km->nfree > 2*NBATCH)
+    spill = detach(km, NBATCH);
+  release(&km->lock);
+  pop_off();
+
+  if(spill)
+    bd_freen(spill);
+
+  __sync_fetch_and_sub(&kstat.nalloc, 1);
+}
+
+// Move up to NBATCH pages from another CPU's free list
+// onto km's. Holds only one kmem lock at a time, so that
+// two CPUs stealing from each other can't deadlock.
+// Returns the number of pages stolen.
+static int
+steal(struct kmem *km)
+{
+  struct kmem *victim;
+  struct run *list;
+  int n;
+
+  for(victim = kmem; victim < &kmem[NCPU]; victim++){
+    if(victim == km)
+      continue;
+    acquire(&victim->lock);
+    n = victim->nfree;
+    list = detach(victim, NBATCH);
+    n -= victim->nfree;
+    release(&victim->lock);
+    if(list == 0)
+      continue;
+
+    acquire(&km->lock);
+    attach(km, list, n);
+    release(&km->lock);
+    return n;
+  }
+  return 0;
+}
+
+// Refill km's free list from the buddy allocator,
+// or failing that from another CPU.
+// Returns the number of pages added.
+static int
+refill(struct kmem *km)
+{
+  void *list;
+  int n;
+
+  if((n = bd_allocn(NBATCH, &list)) == 0)
+    return steal(km);
+  acquire(&km->lock);
+  attach(km, list, n);
+  release(&km->lock);
+  return n;
+}
+
+// Take a page off this CPU's free list, refilling
+// the list if it's empty. Returns 0 if there are no
+// free pages left outside the zeroed pool.
+static struct run*
+takepage(void)
+{
+  struct run *r;
+  struct kmem *km;
+
+  push_off();
+  km = &kmem[cpuid()];
+  for(;;){
+    acquire(&km->lock);
+    r = km->freelist;
+    if(r){
+      km->freelist = r->next;
+      km->nfree--;
+    }
+    release(&km->lock);
+    if(r || refill(km) == 0)
+      break;
+  }
+  pop_off();
+  return r;
+}
+
+// Take a page out of the zeroed pool, or return 0
+// if it's empty.
+static struct run*
+takezeroed(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  r = zpool.list;
+  if(r){
+    zpool.list = r->next;
+    zpool.n--;
+  }
+  release(&zpool.lock);
+  return r;
+}
+
+// Account for a page newly allocated by a call from pc.
+static void*
+allocated(struct run *r, uint64 pc)
+{
+  if(r == 0){
+    __sync_fetch_and_add(&kstat.nfail, 1);
+    return 0;
+  }
+  countalloc(1);
+  pgref[PA2PGIDX(r)] = 1;
+  setowner(r, 1, pc);
+  return (void*)r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -70,30 +318,224 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  if((r = takepage()) == 0)
+    r = takezeroed();
+  if(allocated(r, (uint64)__builtin_return_address(0)) == 0)
+    return 0;
 
-  if(r)
-    memset((char*)r, 5, PGSIZE); // fill with junk
+#ifdef KALLOC_POISON
+  memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
   return (void*)r;
 }
 
+// Allocate one 4096-byte page of physical memory,
+// filled with zeros. Uses a pre-zeroed page if
+// there is one.
+// Returns 0 if the memory cannot be allocated.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  uint64 pc = (uint64)__builtin_return_address(0);
+
+  if((r = takezeroed()) != 0)
+    return allocated(r, pc);
+  if(allocated(r = takepage(), pc) == 0)
+    return 0;
+  memset((char*)r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Zero a few free pages into the pool for kalloc_zeroed().
+// Called by the scheduler on a CPU with nothing to run.
+// Returns the number of pages zeroed; 0 means the pool is
+// full, or there's no free memory to put in it.
+int
+kzerofill(void)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < NZFILL && zpool.n < NZPOOL; i++){
+    if((r = takepage()) == 0)
+      break;
+    memset((char*)r, 0, PGSIZE);
+    acquire(&zpool.lock);
+    r->next = zpool.list;
+    zpool.list = r;
+    zpool.n++;
+    release(&zpool.lock);
+  }
+  return i;
+}
+
+// Add a reference to a page that kalloc() returned.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&pgref[PA2PGIDX(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to a page
+// that kalloc() returned.
+int
+krefcnt(void *pa)
+{
+  return pgref[PA2PGIDX(pa)];
+}
+
+// Return the shared page of zeros, which may only be
+// mapped read-only, with kdup().
+void *
+kzeropage(void)
+{
+  return zeropage;
+}
+
+// Allocate 2^order physically contiguous pages, aligned
+// to their size, straight from the buddy allocator.
+// Returns 0 if the memory cannot be allocated.
+void *
+kallocpages(int order)
+{
+  void *pa;
+
+  if((pa = bd_alloc(order)) == 0){
+    __sync_fetch_and_add(&kstat.nfail, 1);
+    return 0;
+  }
+  countalloc(1 << order);
+  setowner(pa, 1 << order, (uint64)__builtin_return_address(0));
+
+#ifdef KALLOC_POISON
+  memset(pa, 5, PGSIZE << order); // fill with junk
+#endif
+  return pa;
+}
+
+// Free memory that kallocpages(order) returned.
+void
+kfreepages(void *pa, int order)
+{
+  if(order < 0 || order > MAXORDER || ((uint64)pa % (PGSIZE << order)) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfreepages");
+  setowner(pa, 1 << order, 0);
+
+#ifdef KALLOC_POISON
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  bd_free(pa, order);
+  __sync_fetch_and_sub(&kstat.nalloc, 1 << order);
+}
+
+// Return the number of free bytes. Sums the per-CPU
+// counts without locking, so the result is only exact
+// when no other CPU is allocating.
 uint64
 knfreemem()
 {
-    int page_cnt = 0;
+  uint64 n = bd_nfree() + zpool.n;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n * PGSIZE;
+}
+
+// Promise npages of free memory to pages that will only be
+// allocated when first touched, as with sbrk(). Fails if
+// fewer than npages free pages aren't already promised.
+// The promise is soft: kalloc() doesn't hold reserved
+// pages back, so a later fault may still find no memory.
+// Returns 0 on success, -1 on failure.
+int
+kreserve(uint64 npages)
+{
+  uint64 old, nfree;
+
+  do {
+    old = kstat.nresv;
+    nfree = knfreemem() / PGSIZE;
+    if(nfree < old || nfree - old < npages)
+      return -1;
+  } while(__sync_val_compare_and_swap(&kstat.nresv, old, old + npages) != old);
+  return 0;
+}
+
+// Give back npages reserved by kreserve(), either because
+// they have now been allocated or are no longer wanted.
+void
+kunreserve(uint64 npages)
+{
+  __sync_fetch_and_sub(&kstat.nresv, npages);
+}
+
+// Fill in the memory fields of a struct sysinfo.
+// Reserved pages don't count as free.
+void
+kmeminfo(struct sysinfo *info)
+{
+  uint64 nfree = knfreemem() / PGSIZE;
 
-    acquire(&kmem.lock);
-    struct run *r;
-    r = kmem.freelist;
-    while (r) {
-        page_cnt++;
-        r = r->next;
+  info->freemem = nfree > kstat.nresv ? (nfree - kstat.nresv) * PGSIZE : 0;
+  info->allocmem = kstat.nalloc * PGSIZE;
+  info->peakmem = kstat.peak * PGSIZE;
+  info->nallocfail = kstat.nfail;
+  info->nzeromap = krefcnt(zeropage) - 1;
+}
+
+// Fill in sites[0..max-1] with the number of pages still
+// allocated from each call site, by process, counting only
+// those of process pid, or all if pid is -1. Reads the
+// owners without locking, so the counts are approximate.
+// Returns the number of sites, or -1 if pages aren't traced.
+int
+kallocsites(int pid, struct kallocsite *sites, int max)
+{
+#ifdef KALLOC_TRACE
+  int i, j, n = 0;
+
+  for(i = 0; i < NPHYSPAGE; i++){
+    if(owner[i].pc == 0 || (pid != -1 && owner[i].pid != pid))
+      continue;
+    for(j = 0; j < n; j++)
+      if(sites[j].pc == owner[i].pc && sites[j].pid == owner[i].pid)
+        break;
+    if(j == n){
+      if(n == max)
+        continue;
+      sites[n].pc = owner[i].pc;
+      sites[n].pid = owner[i].pid;
+      sites[n].npages = 0;
+      n++;
     }
-    release(&kmem.lock);
+    sites[j].npages++;
+  }
+  return n;
+#else
+  return -1;
+#endif
+}
 
-    return page_cnt * PGSIZE;
+// Print the number of free pages on each CPU's list,
+// and the buddy allocator's free blocks.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmemdump(void)
+{
+  printf("free pages:");
+  for(int i = 0; i < NCPU; i++)
+    printf(" cpu%d=%d", i, (int)kmem[i].nfree);
+  printf(" zeroed=%d\n", (int)zpool.n);
+  bd_dump();
+  kmem_cache_dump();
+  swapdump();
 }
@@ -27,6 +27,7 @@
 
 // local interrupt controller, which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -41,12 +42,24 @@
 #define PLIC_MCLAIM(hart) (PLIC + 0x200004 + (hart)*0x2000)
 #define PLIC_SCLAIM(hart) (PLIC + 0x201004 + (hart)*0x2000)
 
+// the kernel maps the CLINT here too, above MMAPTOP, so that
+// it can reach the CLINT with a process's kernel page table.
+#define KCLINT (PLIC + 0x400000)
+#define KCLINT_MSIP(hartid) (KCLINT + 4*(hartid))
+#define KCLINT_MTIMECMP(hartid) (KCLINT + 0x4000 + 8*(hartid))
+#define KCLINT_MTIME (KCLINT + 0xBFF8)
+
 // the kernel expects there to be RAM
 // for use by the kernel and user pages
 // from physical address 0x80000000 to PHYSTOP.
 #define KERNBASE 0x80000000L
 #define PHYSTOP (KERNBASE + 128*1024*1024)
 
+// number of physical pages from KERNBASE to PHYSTOP, and
+// the index among them of the page containing pa.
+#define NPHYSPAGE ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2PGIDX(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
 // map the trampoline page to the highest address,
 // in both user and kernel space.
 #define TRAMPOLINE (MAXVA - PGSIZE)
@@ -62,6 +75,20 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() regions, allocated downward from MMAPTOP
+//   ...
+//   TTRAPFRAME(slot) (each thread's p->trapframe)
+//   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
+// the kernel's page table for each process shares the user
+// page table's mappings below MMAPTOP, which must be a
+// multiple of 2MB; see kvmcreate().
+#define MMAPTOP PLIC
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// the threads of a process share its user page table, so
+// each other thread's trapframe needs an address of its own.
+// they go below the kernel stacks, since the kernel page
+// tables use the same ASID as the user page table.
+#define TTRAPFRAME(slot) (KSTACK(NPROC) - ((slot)+1)*PGSIZE)
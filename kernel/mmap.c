@@ -0,0 +1,381 @@
+//
+// Memory-mapped files and anonymous memory: mmap() and munmap().
+//
+// Each process has a small table of mapped regions (struct vma),
+// placed between the top of its heap and MMAPTOP. Pages of a
+// region are allocated, or read from the file, when first
+// touched. Whole pages of a file that the process can't write
+// through to the file come from the same per-inode cache that
+// exec() uses (see exec.c), so scanning a file through a mapping
+// copies nothing once the pages are cached; private writable
+// mappings get them copy-on-write. Pages of a shared writable
+// file mapping are the process's own, and munmap() and exit()
+// write the dirty ones back to the file.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+
+// Return the region of p that contains va, or 0.
+static struct vma*
+findvma(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Does any region of p overlap [start, end)?
+static int
+overlaps(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && start < v->end && v->start < end)
+      return 1;
+  return 0;
+}
+
+// Return the lowest address mapped by mmap() in p, or
+// MMAPTOP if there is none. The heap can't grow past it.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = MMAPTOP;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Return 1 if faulting in the page at va would read
+// from a file, 0 if not.
+int
+mmapbacked(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  return (v = findvma(p, va)) != 0 && v->f != 0;
+}
+
+// Map a new region of len bytes into the current process,
+// at the highest free address that fits below MMAPTOP.
+// f is the file to map, or 0 for anonymous memory.
+// Not for a process with threads; see clone().
+// Returns the region's address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free = 0;
+  uint64 top, best = 0;
+  int i;
+
+  if(p->nthread != 1)
+    return -1;
+  if(len == 0 || len > MMAPTOP || off % PGSIZE != 0 || off + len < off)
+    return -1;
+  if((flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+     (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE))
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || f->readable == 0)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && f->writable == 0)
+      return -1;
+  }
+  len = PGROUNDUP(len);
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0)
+      free = v;
+  if(free == 0)
+    return -1;
+
+  // the candidates are just below MMAPTOP and
+  // just below each region.
+  for(i = -1; i < NVMA; i++){
+    if(i >= 0 && p->vma[i].end == 0)
+      continue;
+    top = i < 0 ? MMAPTOP : p->vma[i].start;
+    if(top < len || top - len < PGROUNDUP(p->sz) || top - len <= best)
+      continue;
+    if(overlaps(p, top - len, top))
+      continue;
+    best = top - len;
+  }
+  if(best == 0)
+    return -1;
+
+  free->start = best;
+  free->end = best + len;
+  free->prot = prot;
+  free->flags = flags;
+  free->f = f ? filedup(f) : 0;
+  free->off = off;
+  return best;
+}
+
+// Write the page pa, mapped at va in v, back to v's file.
+// Doesn't make the file any longer.
+static void
+writeback(struct vma *v, uint64 va, char *pa)
+{
+  struct inode *ip = v->f->ip;
+  uint64 off = v->off + (va - v->start);
+  uint64 n, n1, i;
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+
+  ilock(ip);
+  n = ip->size > off ? ip->size - off : 0;
+  iunlock(ip);
+  if(n > PGSIZE)
+    n = PGSIZE;
+
+  // a few blocks at a time, as in filewrite().
+  for(i = 0; i < n; i += n1){
+    n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+    begin_op();
+    ilock(ip);
+    writei(ip, 0, (uint64)pa + i, off + i, n1);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Remove the pages of [start, end) in v from p's page table.
+// If sync is set, first write the dirty pages of a shared
+// file mapping back to the file.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 start, uint64 end, int sync)
+{
+  uint64 a;
+  pte_t *pte;
+
+  for(a = start; a < end; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(sync && v->f && (v->flags & MAP_SHARED) && (*pte & PTE_D))
+      writeback(v, a, (char*)PTE2PA(*pte));
+    uvmunmap(p->pagetable, a, 1, 1);
+  }
+}
+
+// Unmap [addr, addr+len) from the current process. The range
+// may cover several regions, or part of one.
+// Not for a process with threads; see clone().
+// Returns 0 on success, -1 on failure.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v, *w = 0;
+  uint64 end, s, e;
+
+  end = addr + PGROUNDUP(len);
+  if(p->nthread != 1)
+    return -1;
+  if(addr % PGSIZE != 0 || len == 0 || end < addr)
+    return -1;
+
+  // a hole in the middle of a region splits it in two.
+  if((v = findvma(p, addr)) != 0 && addr > v->start && end < v->end){
+    for(w = p->vma; w < &p->vma[NVMA] && w->end; w++)
+      ;
+    if(w == &p->vma[NVMA])
+      return -1;
+  }
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || end <= v->start || v->end <= addr)
+      continue;
+    s = addr > v->start ? addr : v->start;
+    e = end < v->end ? end : v->end;
+    vmaunmap(p, v, s, e, 1);
+    if(s == v->start && e == v->end){
+      if(v->f)
+        fileclose(v->f);
+      v->end = 0;
+    } else if(s == v->start){
+      v->off += e - v->start;
+      v->start = e;
+    } else if(e == v->end){
+      v->end = s;
+    } else {
+      *w = *v;
+      w->off += e - v->start;
+      w->start = e;
+      if(w->f)
+        filedup(w->f);
+      v->end = s;
+    }
+  }
+  return 0;
+}
+
+// Unmap every region of p, as exit() and exec() must.
+void
+mmapclear(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0)
+      continue;
+    vmaunmap(p, v, v->start, v->end, 1);
+    if(v->f)
+      fileclose(v->f);
+    v->end = 0;
+  }
+}
+
+// Map the page of v at va into p, a leader, unless another
+// of its threads has done so meanwhile. May sleep.
+// Returns 0 on success, -1 on failure.
+static int
+vmaload(struct proc *p, struct vma *v, uint64 va)
+{
+  struct inode *ip;
+  uint64 off, n;
+  char *mem = 0;
+  int perm = PTE_U, r;
+
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  if(v->f == 0){
+    mem = kalloc_zeroed();
+  } else {
+    ip = v->f->ip;
+    off = v->off + (va - v->start);
+    ilock(ip);
+    if(!((v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)) &&
+       off + PGSIZE <= ip->size && (mem = textpage(ip, off)) != 0){
+      if(perm & PTE_W)
+        perm = (perm & ~PTE_W) | PTE_COW;
+    } else if((mem = kalloc_zeroed()) != 0 && off < ip->size){
+      n = ip->size - off;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      if(readi(ip, 0, (uint64)mem, off, n) != n){
+        kfree(mem);
+        mem = 0;
+      }
+    }
+    iunlock(ip);
+  }
+  if(mem == 0)
+    return -1;
+
+  if((r = uvmfill(p, va, (uint64)mem, perm)) != 0){
+    kfree(mem);
+    return r < 0 ? -1 : 0;
+  }
+  return 0;
+}
+
+// Handle a fault on a page at va that p hasn't touched,
+// if va lies in one of p's regions. May sleep.
+// Returns 0 if the access can now go ahead, -1 if not.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+
+  if((v = findvma(p, va)) == 0)
+    return -1;
+  if(write && (v->prot & PROT_WRITE) == 0)
+    return -1;
+  if(!write && (v->prot & (PROT_READ|PROT_EXEC)) == 0)
+    return -1;
+  return vmaload(p, v, PGROUNDDOWN(va));
+}
+
+// Fault in every page of p's shared regions, so that
+// fork() can share the pages themselves with the child.
+// Returns 0 on success, -1 if there's no memory.
+int
+mmappopulate(struct proc *p)
+{
+  struct vma *v;
+  uint64 a;
+  pte_t *pte;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || (v->flags & MAP_SHARED) == 0)
+      continue;
+    for(a = v->start; a < v->end; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) != 0 && (*pte & PTE_V))
+        continue;
+      if(vmaload(p, v, a) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Give the child np of fork() p's regions. Pages of shared
+// regions are shared; those of private ones become
+// copy-on-write. Call mmappopulate(p) first.
+// Returns 0 on success, -1 on failure.
+int
+mmapfork(struct proc *p, struct proc *np)
+{
+  struct vma *v, *nv;
+  uint64 a, pa;
+  pte_t *pte;
+
+  for(v = p->vma, nv = np->vma; v < &p->vma[NVMA]; v++, nv++){
+    if(v->end == 0)
+      continue;
+    *nv = *v;
+    if(nv->f)
+      filedup(nv->f);
+    for(a = v->start; a < v->end; a += PGSIZE){
+      if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+        continue;
+      if((v->flags & MAP_PRIVATE) && (*pte & PTE_W))
+        *pte = (*pte & ~PTE_W) | PTE_COW;
+      pa = PTE2PA(*pte);
+      if(mappages(np->pagetable, a, PGSIZE, pa, PTE_FLAGS(*pte)) != 0)
+        goto err;
+      kdup((void*)pa);
+    }
+  }
+  uvmflushall(p->pagetable);
+  return 0;
+
+ err:
+  // the child's pages are all the parent's too,
+  // so there's nothing to write back.
+  for(nv = np->vma; nv < &np->vma[NVMA]; nv++){
+    if(nv->end == 0)
+      continue;
+    vmaunmap(np, nv, nv->start, nv->end, 0);
+    if(nv->f)
+      fileclose(nv->f);
+    nv->end = 0;
+  }
+  return -1;
+}
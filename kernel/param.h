@@ -1,13 +1,22 @@
-#define NPROC        64  // maximum number of processes
+#define NPROC       512  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define USTACKSIZE   64  // max pages of user stack
+#define NSEG          4  // max loadable segments in a program
+#define NVMA         16  // mmap() regions per process
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE       1000  // size of file system in blocks
+#define SWAPSIZE     4096  // size of swap area after the file system, in blocks
 #define MAXPATH      128   // maximum file path name
+#define MAXORDER     10    // largest buddy block is 2^MAXORDER pages
+#define NPRIO        4     // scheduling priority levels
+#define QUANTUM      2     // ticks of a time slice at priority 0; doubles per level
+#define BOOSTTICKS   50    // ticks between raising every process to its nice level
+#define MTIMEHZ      10000000 // CLINT mtime cycles per second in qemu
+#define INTERVAL     (MTIMEHZ/10) // mtime cycles per tick
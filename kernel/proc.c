@@ -5,18 +5,66 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "fcntl.h"
+#include "slab.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// the process table: the first nproc entries point to procs
+// from proccache, made as they were needed. a proc is never
+// freed, only marked UNUSED, so a pointer to one is always
+// safe to lock. proc[i]'s kernel stack is at KSTACK(i) while
+// p->kstack is set; it stays there for the next process to
+// use the proc, until procreap() frees it.
+struct proc *proc[NPROC];
+int nproc;
+struct spinlock proc_lock;  // for adding to proc[]
+static struct kmem_cache proccache;
 
 struct proc *initproc;
 
+// the RUNNABLE processes waiting for each CPU: a queue for
+// each priority, in the order they became runnable. a CPU
+// with none takes one from another CPU's queues. the lock
+// also protects p->prio of the processes queued.
+// lock order: p->lock, then a queue's.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+} runq[NCPU];
+
+// the processes sleeping on each channel, hashed by channel,
+// so that wakeup() looks only at those that might be on its
+// channel. lock order: a queue's lock, then p->lock.
+#define NSLEEPQ 64
+#define SLEEPQ(chan) (&sleepq[((uint64)(chan) * 0x9E3779B97F4A7C15ULL) >> 58])
+
+struct sleepq {
+  struct spinlock lock;
+  struct proc *head;
+} sleepq[NSLEEPQ];
+
+// a multi-level feedback queue: a process that uses up its
+// time slice drops a priority, and gets a slice twice as
+// long. every BOOSTTICKS ticks, boost() puts every process
+// back at its nice level, so none starves.
+uint boosts;
+
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// the processes with each pid, hashed, for findproc().
+#define NPIDHASH 64
+struct proc *pidhash[NPIDHASH];
+
+// helps ensure that wakeups of wait()ing
+// parents are not lost. protects p->parent
+// and the children lists. must be acquired
+// before any p->lock.
+struct spinlock wait_lock;
+
 extern void forkret(void);
-static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
@@ -25,25 +73,66 @@ extern char trampoline[]; // trampoline.S
 void
 procinit(void)
 {
-  struct proc *p;
+  int i;
   
   initlock(&pid_lock, "nextpid");
-  for(p = proc; p < &proc[NPROC]; p++) {
-      initlock(&p->lock, "proc");
-
-      // Allocate a page for the process's kernel stack.
-      // Map it high in memory, followed by an invalid
-      // guard page.
-      char *pa = kalloc();
-      if(pa == 0)
-        panic("kalloc");
-      uint64 va = KSTACK((int) (p - proc));
-      kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-      p->kstack = va;
-  }
+  initlock(&wait_lock, "wait_lock");
+  initlock(&proc_lock, "proctable");
+  kmem_cache_init(&proccache, "proc", sizeof(struct proc));
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(i = 0; i < NSLEEPQ; i++)
+    initlock(&sleepq[i].lock, "sleepq");
   kvminithart();
 }
 
+// Add a new proc to the table, and return it with p->lock
+// held, or return 0 if the table is full or there's no memory.
+static struct proc*
+newproc(void)
+{
+  struct proc *p;
+
+  acquire(&proc_lock);
+  if(nproc == NPROC || (p = kmem_cache_alloc(&proccache)) == 0){
+    release(&proc_lock);
+    return 0;
+  }
+  memset(p, 0, sizeof(*p));
+  initlock(&p->lock, "proc");
+  initlock(&p->vmlock, "vm");
+  p->state = UNUSED;
+  p->slot = nproc;
+  acquire(&p->lock);
+  proc[nproc] = p;
+  // others scan proc[] without proc_lock.
+  __sync_synchronize();
+  nproc++;
+  release(&proc_lock);
+  return p;
+}
+
+// Free the kernel stacks of UNUSED procs, for memory.
+// Returns the number of pages freed.
+int
+procreap(void)
+{
+  struct proc *p;
+  int i, n = 0;
+
+  for(i = 0; i < nproc; i++){
+    p = proc[i];
+    acquire(&p->lock);
+    if(p->state == UNUSED && p->kstack){
+      kvmfree(p->kstack);
+      p->kstack = 0;
+      n++;
+    }
+    release(&p->lock);
+  }
+  return n;
+}
+
 // Must be called with interrupts disabled,
 // to prevent race with process being moved
 // to a different CPU.
@@ -73,28 +162,64 @@ myproc(void) {
   return p;
 }
 
-int
-allocpid() {
-  int pid;
-  
+// Give p a new pid, and enter it in pidhash[].
+static void
+allocpid(struct proc *p)
+{
   acquire(&pid_lock);
-  pid = nextpid;
+  p->pid = nextpid;
   nextpid = nextpid + 1;
+  p->pidnext = pidhash[p->pid % NPIDHASH];
+  pidhash[p->pid % NPIDHASH] = p;
   release(&pid_lock);
+}
 
-  return pid;
+// Take p out of pidhash[], as freeproc() must.
+static void
+freepid(struct proc *p)
+{
+  struct proc **pp;
+
+  acquire(&pid_lock);
+  for(pp = &pidhash[p->pid % NPIDHASH]; *pp; pp = &(*pp)->pidnext){
+    if(*pp == p){
+      *pp = p->pidnext;
+      break;
+    }
+  }
+  release(&pid_lock);
+}
+
+// Return the process with the given pid, or 0. The caller
+// must lock it and check its pid again before relying on it,
+// since it may exit meanwhile.
+static struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  acquire(&pid_lock);
+  for(p = pidhash[pid % NPIDHASH]; p; p = p->pidnext)
+    if(p->pid == pid)
+      break;
+  release(&pid_lock);
+  return p;
 }
 
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
-// and return with p->lock held.
+// and return with p->lock held. With leader set, the proc is
+// a new thread of leader's process, sharing its memory;
+// otherwise it's a new process, with no user memory.
 // If there are no free procs, or a memory allocation fails, return 0.
 static struct proc*
-allocproc(void)
+allocproc(struct proc *leader)
 {
   struct proc *p;
+  int i, r;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  for(i = 0; i < nproc; i++) {
+    p = proc[i];
     acquire(&p->lock);
     if(p->state == UNUSED) {
       goto found;
@@ -102,20 +227,69 @@ allocproc(void)
       release(&p->lock);
     }
   }
-  return 0;
+  if((p = newproc()) == 0)
+    return 0;
 
 found:
-  p->pid = allocpid();
+  // Map a page for the process's kernel stack, if the
+  // proc doesn't have one already. It's high in memory,
+  // followed by an invalid guard page.
+  if(p->kstack == 0){
+    if(kvmalloc(KSTACK(p->slot)) < 0){
+      release(&p->lock);
+      return 0;
+    }
+    p->kstack = KSTACK(p->slot);
+  }
+
+  p->leader = leader ? leader : p;
+  allocpid(p);
+  p->state = USED;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
+    freeproc(p);
     release(&p->lock);
     return 0;
   }
 
-  // An empty user page table.
-  p->pagetable = proc_pagetable(p);
-  if(p->pagetable == 0){
+  if(leader == 0){
+    // An empty user page table.
+    p->pagetable = proc_pagetable(p);
+    if(p->pagetable == 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->trapva = TRAPFRAME;
+    p->nthread = 1;
+    // no ASID until the process first runs.
+    p->asidgen = 0;
+  } else {
+    // the leader's page table, with the trapframe
+    // somewhere of its own.
+    p->trapva = TTRAPFRAME(p->slot);
+    acquire(&leader->vmlock);
+    r = mappages(leader->pagetable, p->trapva, PGSIZE,
+                 (uint64)p->trapframe, PTE_R | PTE_W);
+    release(&leader->vmlock);
+    if(r != 0){
+      freeproc(p);
+      release(&p->lock);
+      return 0;
+    }
+    p->pagetable = leader->pagetable;
+    p->nthread = 0;
+  }
+  p->lastcpu = -1;
+
+  p->prio = p->nice = 0;
+  p->slice = 0;
+  p->boosts = boosts;
+
+  // A kernel page table that maps user memory too.
+  p->kpagetable = kvmcreate(p->pagetable);
+  if(p->kpagetable == 0){
     freeproc(p);
     release(&p->lock);
     return 0;
@@ -131,18 +305,30 @@ found:
 }
 
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages, unless it's a thread, whose
+// memory is its leader's.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
+  if(p->pagetable && p->leader != p){
+    acquire(&p->leader->vmlock);
+    uvmunmap(p->pagetable, p->trapva, 1, 0);
+    release(&p->leader->vmlock);
+  } else if(p->pagetable)
+    proc_freepagetable(p->pagetable, p->sz);
+  p->pagetable = 0;
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
-  p->pagetable = 0;
+  if(p->kpagetable)
+    kfree((void*)p->kpagetable);
+  p->kpagetable = 0;
   p->sz = 0;
+  p->nthread = 0;
+  p->nseg = 0;
+  if(p->pid)
+    freepid(p);
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
@@ -213,7 +399,7 @@ userinit(void)
 {
   struct proc *p;
 
-  p = allocproc();
+  p = allocproc(0);
   initproc = p;
   
   // allocate one user page and copy init's instructions
@@ -226,56 +412,104 @@ userinit(void)
   p->trapframe->sp = PGSIZE;  // user stack pointer
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  if((p->fdt = fdtalloc()) == 0)
+    panic("userinit");
+  p->fdt->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
-// Return 0 on success, -1 on failure.
-int
+// Growing only reserves memory; usertrap() allocates
+// each new page when the process first touches it.
+// Return the old size, or -1 on failure.
+uint64
 growproc(int n)
 {
-  uint sz;
-  struct proc *p = myproc();
+  uint64 sz, npages;
+  struct proc *p = myproc()->leader;
 
-  sz = p->sz;
-  if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+  while(n > 0){
+    sz = p->sz;
+    if(sz + n > mmapbase(p))
+      return -1;
+    npages = (PGROUNDUP(sz + n) - PGROUNDUP(sz)) / PGSIZE;
+    // if memory is short, shrink the caches or swap
+    // pages out, and try again.
+    if(kreserve(npages) < 0 &&
+       (kmem_reap() + itextreap() + procreap() == 0 || kreserve(npages) < 0) &&
+       (swapout(npages) == 0 || kreserve(npages) < 0))
       return -1;
+    // another thread may have moved sz meanwhile.
+    acquire(&p->vmlock);
+    if(p->sz == sz){
+      p->sz = sz + n;
+      release(&p->vmlock);
+      return sz;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    release(&p->vmlock);
+    kunreserve(npages);
   }
-  p->sz = sz;
-  return 0;
+
+  acquire(&p->vmlock);
+  sz = p->sz;
+  if(n < 0){
+    p->sz = uvmdealloc(p->pagetable, sz, sz + n);
+    segclip(p, PGROUNDUP(p->sz));
+  }
+  release(&p->vmlock);
+  return sz;
 }
 
-// Create a new process, copying the parent.
+// Create a new process, copying the parent, the process
+// of the calling thread, which becomes the child's parent.
 // Sets up child kernel stack to return as if from fork() system call.
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
+  struct fdtable *fdt;
   struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  // the child shares the pages of shared mappings,
+  // so they must all exist first.
+  if(mmappopulate(l) < 0)
+    return -1;
+
+  // copy the open files and current directory first;
+  // giving them back may sleep, so no lock can be held.
+  if((fdt = fdtcopy(p->fdt)) == 0)
+    return -1;
 
   // Allocate process.
-  if((np = allocproc()) == 0){
+  if((np = allocproc(0)) == 0){
+    fdtclose(fdt);
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  // Copy user memory from parent to child, which the
+  // parent's other threads mustn't change meanwhile.
+  acquire(&l->vmlock);
+  if(uvmcopy(l->pagetable, np->pagetable, l->sz) < 0){
+    release(&l->vmlock);
     freeproc(np);
     release(&np->lock);
+    fdtclose(fdt);
     return -1;
   }
-  np->sz = p->sz;
-
-  np->parent = p;
+  np->sz = l->sz;
+  if(mmapfork(l, np) < 0){
+    release(&l->vmlock);
+    freeproc(np);
+    release(&np->lock);
+    fdtclose(fdt);
+    return -1;
+  }
+  release(&l->vmlock);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -283,54 +517,254 @@ fork(void)
   // Cause fork to return 0 in the child.
   np->trapframe->a0 = 0;
 
-  // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
-  np->cwd = idup(p->cwd);
+  np->fdt = fdt;
+  if(l->exe)
+    np->exe = idup(l->exe);
+  memmove(np->seg, l->seg, sizeof(l->seg));
+  np->nseg = l->nseg;
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
-
   np->mask = p->mask;
+  np->prio = np->nice = p->nice;
 
   release(&np->lock);
 
+  acquire(&wait_lock);
+  np->parent = l;
+  np->sibprev = 0;
+  np->sibnext = l->children;
+  if(l->children)
+    l->children->sibprev = np;
+  l->children = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  setrunnable(np);
+  release(&np->lock);
+
   return pid;
 }
 
+// Take child np off its parent's list of children.
+// Caller must hold wait_lock.
+static void
+unchild(struct proc *np)
+{
+  if(np->sibprev)
+    np->sibprev->sibnext = np->sibnext;
+  else
+    np->parent->children = np->sibnext;
+  if(np->sibnext)
+    np->sibnext->sibprev = np->sibprev;
+}
+
 // Pass p's abandoned children to init.
-// Caller must hold p->lock.
+// Caller must hold wait_lock.
 void
 reparent(struct proc *p)
 {
-  struct proc *pp;
-
-  for(pp = proc; pp < &proc[NPROC]; pp++){
-    // this code uses pp->parent without holding pp->lock.
-    // acquiring the lock first could cause a deadlock
-    // if pp or a child of pp were also in exit()
-    // and about to try to lock p.
-    if(pp->parent == p){
-      // pp->parent can't change between the check and the acquire()
-      // because only the parent changes it, and we're the parent.
-      acquire(&pp->lock);
-      pp->parent = initproc;
-      // we should wake up init here, but that would require
-      // initproc->lock, which would be a deadlock, since we hold
-      // the lock on one of init's children (pp). this is why
-      // exit() always wakes init (before acquiring any locks).
-      release(&pp->lock);
+  struct proc *pp, *next;
+
+  if(p->children == 0)
+    return;
+  for(pp = p->children; pp; pp = next){
+    next = pp->sibnext;
+    pp->parent = initproc;
+    pp->sibprev = 0;
+    pp->sibnext = initproc->children;
+    if(initproc->children)
+      initproc->children->sibprev = pp;
+    initproc->children = pp;
+  }
+  p->children = 0;
+  // some may be zombies already.
+  wakeup(initproc);
+}
+
+// Create a thread of the current process, to run fn(arg) in
+// its memory, on the stack that ends at stack. fn mustn't
+// return; the thread ends with exit(), or when the process's
+// leader does. It shares the process's file descriptors and
+// current directory, as well as its memory.
+// Returns the new thread's id, or -1.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int tid;
+  struct proc *np;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  if((np = allocproc(l)) == 0)
+    return -1;
+  release(&np->lock);
+
+  // join the process's threads first, unless it's on its way
+  // out: once reapthreads() has seen the last thread go, the
+  // memory may be freed at any time.
+  acquire(&wait_lock);
+  acquire(&l->lock);
+  if(l->killed){
+    release(&l->lock);
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    release(&wait_lock);
+    return -1;
+  }
+  l->nthread++;
+  release(&l->lock);
+  np->thrprev = 0;
+  np->thrnext = l->threads;
+  if(l->threads)
+    l->threads->thrprev = np;
+  l->threads = np;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->sp = stack & ~0xfL;
+  np->trapframe->a0 = arg;
+  // returning from fn faults.
+  np->trapframe->ra = MAXVA;
+
+  np->fdt = fdtdup(p->fdt);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+
+  tid = np->pid;
+
+  np->mask = p->mask;
+  np->prio = np->nice = p->nice;
+
+  setrunnable(np);
+  release(&np->lock);
+
+  return tid;
+}
+
+// Take zombie thread t off its leader's list, and free it.
+// Caller must hold wait_lock and t->lock; releases t->lock.
+static void
+freethread(struct proc *t)
+{
+  struct proc *l = t->leader;
+
+  if(t->thrprev)
+    t->thrprev->thrnext = t->thrnext;
+  else
+    l->threads = t->thrnext;
+  if(t->thrnext)
+    t->thrnext->thrprev = t->thrprev;
+  freeproc(t);
+  release(&t->lock);
+
+  acquire(&l->lock);
+  l->nthread--;
+  release(&l->lock);
+}
+
+// Mark p killed, and wake it if it's sleeping.
+// Caller must hold p->lock.
+static void
+setkilled(struct proc *p)
+{
+  p->killed = 1;
+  if(p->state == SLEEPING){
+    // Wake process from sleep().
+    setrunnable(p);
+  }
+}
+
+// Kill the other threads of p, a leader that is exiting,
+// and wait for them all to exit, freeing them. p is marked
+// killed too, so that clone() can't add another meanwhile.
+static void
+reapthreads(struct proc *p)
+{
+  struct proc *t, *next;
+
+  acquire(&wait_lock);
+  acquire(&p->lock);
+  p->killed = 1;
+  release(&p->lock);
+  while(p->threads){
+    for(t = p->threads; t; t = next){
+      next = t->thrnext;
+      acquire(&t->lock);
+      if(t->state == ZOMBIE){
+        freethread(t);
+        continue;
+      }
+      setkilled(t);
+      release(&t->lock);
+    }
+    if(p->threads)
+      sleep(p, &wait_lock);
+  }
+  release(&wait_lock);
+}
+
+// Wait for the thread tid of the current process, or any
+// thread but the caller if tid is -1, to exit, and return
+// its id, with its exit status at addr unless addr is 0.
+// Return -1 if the process has no such thread.
+int
+join(int tid, uint64 addr)
+{
+  struct proc *t;
+  int found;
+  struct proc *p = myproc();
+  struct proc *l = p->leader;
+
+  // the copyout() below runs with locks held.
+  if(addr != 0)
+    uvmprefault(p->pagetable, addr, sizeof(int));
+
+  acquire(&wait_lock);
+
+  for(;;){
+    found = 0;
+    for(t = l->threads; t; t = t->thrnext){
+      if(t == p || (tid != -1 && t->pid != tid))
+        continue;
+      found = 1;
+      acquire(&t->lock);
+      if(t->state == ZOMBIE){
+        tid = t->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&t->xstate,
+                                sizeof(t->xstate)) < 0) {
+          release(&t->lock);
+          release(&wait_lock);
+          return -1;
+        }
+        freethread(t);
+        release(&wait_lock);
+        return tid;
+      }
+      release(&t->lock);
     }
+
+    if(!found || p->killed){
+      release(&wait_lock);
+      return -1;
+    }
+
+    // exit() wakes the leader's channel.
+    sleep(l, &wait_lock);
   }
 }
 
-// Exit the current process.  Does not return.
+// Exit the current thread.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait().
+// until its parent calls wait(), and an exited
+// thread until another calls join(). The leader
+// takes the rest of the process's threads with it.
 void
 exit(int status)
 {
@@ -339,55 +773,38 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
+  if(p == p->leader){
+    reapthreads(p);
+    // Write back and unmap mmap() regions.
+    mmapclear(p);
   }
 
-  begin_op();
-  iput(p->cwd);
-  end_op();
-  p->cwd = 0;
-
-  // we might re-parent a child to init. we can't be precise about
-  // waking up init, since we can't acquire its lock once we've
-  // acquired any other proc lock. so wake up init whether that's
-  // necessary or not. init may miss this wakeup, but that seems
-  // harmless.
-  acquire(&initproc->lock);
-  wakeup1(initproc);
-  release(&initproc->lock);
-
-  // grab a copy of p->parent, to ensure that we unlock the same
-  // parent we locked. in case our parent gives us away to init while
-  // we're waiting for the parent lock. we may then race with an
-  // exiting parent, but the result will be a harmless spurious wakeup
-  // to a dead or wrong process; proc structs are never re-allocated
-  // as anything else.
-  acquire(&p->lock);
-  struct proc *original_parent = p->parent;
-  release(&p->lock);
-  
-  // we need the parent's lock in order to wake it up from wait().
-  // the parent-then-child rule says we have to lock it first.
-  acquire(&original_parent->lock);
+  // Close all open files, once no thread uses them.
+  fdtclose(p->fdt);
+  p->fdt = 0;
 
-  acquire(&p->lock);
+  if(p->exe){
+    begin_op();
+    iput(p->exe);
+    end_op();
+    p->exe = 0;
+  }
+
+  acquire(&wait_lock);
 
   // Give any children to init.
   reparent(p);
 
-  // Parent might be sleeping in wait().
-  wakeup1(original_parent);
+  // Parent might be sleeping in wait(), or
+  // another thread in join().
+  wakeup(p == p->leader ? p->parent : p->leader);
+  
+  acquire(&p->lock);
 
   p->xstate = status;
   p->state = ZOMBIE;
 
-  release(&original_parent->lock);
+  release(&wait_lock);
 
   // Jump into the scheduler, never to return.
   sched();
@@ -398,59 +815,281 @@ exit(int status)
 // Return -1 if this process has no children.
 int
 wait(uint64 addr)
+{
+  return waitpid(-1, addr, 0);
+}
+
+// Wait for the child with the given pid, or for any child
+// if pid is -1, to exit, and return its pid. With WNOHANG
+// in options, return 0 rather than wait if it hasn't.
+// Return -1 if this process has no such child.
+int
+waitpid(int pid, uint64 addr, int options)
 {
   struct proc *np;
-  int havekids, pid;
+  int havekids;
   struct proc *p = myproc();
+  struct proc *l = p->leader;
 
-  // hold p->lock for the whole time to avoid lost
-  // wakeups from a child's exit().
-  acquire(&p->lock);
+  // no pid is negative, and findproc() wants a real one.
+  if(pid <= 0 && pid != -1)
+    return -1;
+
+  // the copyout() below runs with locks held.
+  if(addr != 0)
+    uvmprefault(p->pagetable, addr, sizeof(int));
+
+  acquire(&wait_lock);
 
   for(;;){
-    // Scan through table looking for exited children.
+    // Look through the children, or just the one, for
+    // one that has exited.
     havekids = 0;
-    for(np = proc; np < &proc[NPROC]; np++){
-      // this code uses np->parent without holding np->lock.
-      // acquiring the lock first would cause a deadlock,
-      // since np might be an ancestor, and we already hold p->lock.
-      if(np->parent == p){
-        // np->parent can't change between the check and the acquire()
-        // because only the parent changes it, and we're the parent.
-        acquire(&np->lock);
-        havekids = 1;
-        if(np->state == ZOMBIE){
-          // Found one.
-          pid = np->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                  sizeof(np->xstate)) < 0) {
-            release(&np->lock);
-            release(&p->lock);
-            return -1;
-          }
-          freeproc(np);
+    np = pid == -1 ? l->children : findproc(pid);
+    for(; np; np = pid == -1 ? np->sibnext : 0){
+      // a child's pid can't change while wait_lock
+      // keeps it our child.
+      if(np->parent != l || (pid != -1 && np->pid != pid))
+        continue;
+      havekids = 1;
+      acquire(&np->lock);
+      if(np->state == ZOMBIE){
+        // Found one.
+        pid = np->pid;
+        if(addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                                sizeof(np->xstate)) < 0) {
           release(&np->lock);
-          release(&p->lock);
-          return pid;
+          release(&wait_lock);
+          return -1;
         }
+        unchild(np);
+        freeproc(np);
         release(&np->lock);
+        release(&wait_lock);
+        return pid;
       }
+      release(&np->lock);
     }
 
     // No point waiting if we don't have any children.
     if(!havekids || p->killed){
-      release(&p->lock);
+      release(&wait_lock);
       return -1;
     }
+    if(options & WNOHANG){
+      release(&wait_lock);
+      return 0;
+    }
     
     // Wait for a child to exit.
-    sleep(p, &p->lock);  //DOC: wait-sleep
+    sleep(l, &wait_lock);  //DOC: wait-sleep
+  }
+}
+
+// Add p to the end of rq's queue for p->prio.
+// Caller must hold rq->lock.
+static void
+append(struct runq *rq, struct proc *p)
+{
+  p->rqnext = 0;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+}
+
+// Make p RUNNABLE, and queue it at its priority for the
+// CPU that last ran it, whose TLB and caches may still hold
+// some of its state, or else for this CPU.
+// Caller must hold p->lock.
+void
+setrunnable(struct proc *p)
+{
+  struct runq *rq;
+  int cpu, i, alone;
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  if(p->boosts != boosts){
+    p->boosts = boosts;
+    p->prio = p->nice;
+    p->slice = 0;
+  }
+
+  cpu = p->lastcpu;
+  if(cpu < 0 || cpu >= NCPU){
+    push_off();
+    cpu = cpuid();
+    pop_off();
+  }
+  rq = &runq[cpu];
+  acquire(&rq->lock);
+  alone = 1;
+  for(i = 0; i < NPRIO; i++)
+    if(rq->head[i])
+      alone = 0;
+  append(rq, p);
+  release(&rq->lock);
+
+  // wake an idle CPU to run p: the one it's queued for,
+  // or any other, which will take it from there. but a
+  // process that yields with nothing else queued runs
+  // next where it is.
+  __sync_synchronize();
+  if(cpus[cpu].idle){
+    kick(cpu);
+    return;
+  }
+  if(p == myproc() && alone)
+    return;
+  for(cpu = 0; cpu < NCPU; cpu++){
+    if(cpus[cpu].idle){
+      kick(cpu);
+      break;
+    }
+  }
+}
+
+// Take the first process of the highest priority off rq,
+// or return 0 if it's empty.
+static struct proc*
+dequeue(struct runq *rq)
+{
+  struct proc *p = 0;
+  int i;
+
+  acquire(&rq->lock);
+  for(i = 0; i < NPRIO; i++){
+    if((p = rq->head[i]) != 0){
+      rq->head[i] = p->rqnext;
+      if(rq->head[i] == 0)
+        rq->tail[i] = 0;
+      p->rqnext = 0;
+      break;
+    }
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Charge a timer tick to the current process, unless the
+// interrupt came sooner, for a sleep deadline or a kick().
+// Returns 1 if it should give up the CPU: it has used up
+// its time slice, and drops a priority, or a process of
+// higher priority is waiting for this CPU.
+int
+timeslice(void)
+{
+  struct proc *p = myproc();
+  struct cpu *c;
+  struct runq *rq;
+  int i, tick;
+
+  push_off();
+  c = mycpu();
+  rq = &runq[cpuid()];
+  tick = c->tick != ticks;
+  c->tick = ticks;
+  pop_off();
+
+  if(tick && ++p->slice >= QUANTUM << p->prio){
+    if(p->prio < NPRIO-1)
+      p->prio++;
+    p->slice = 0;
+    return 1;
+  }
+
+  // no lock: a process queued meanwhile waits a tick.
+  for(i = 0; i < p->prio; i++)
+    if(rq->head[i])
+      return 1;
+  return 0;
+}
+
+// Put every process back at its nice level. Those that
+// are queued move now; the rest move when next queued,
+// seeing that boosts has changed.
+void
+boost(void)
+{
+  struct runq *rq;
+  struct proc *p, *next, *list;
+  int i;
+
+  boosts++;
+  for(rq = runq; rq < &runq[NCPU]; rq++){
+    acquire(&rq->lock);
+    for(i = 1; i < NPRIO; i++){
+      list = rq->head[i];
+      rq->head[i] = rq->tail[i] = 0;
+      for(p = list; p; p = next){
+        next = p->rqnext;
+        p->boosts = boosts;
+        p->prio = p->nice;
+        p->slice = 0;
+        append(rq, p);
+      }
+    }
+    release(&rq->lock);
+  }
+}
+
+// Set the current process's nice level, the priority it
+// returns to at each boost, and its priority now.
+// Returns the old level, or -1 if n isn't a level.
+int
+nice(int n)
+{
+  struct proc *p = myproc();
+  int old = p->nice;
+
+  if(n < 0 || n >= NPRIO)
+    return -1;
+  p->nice = p->prio = n;
+  p->slice = 0;
+  return old;
+}
+
+// Is any process waiting on any CPU's queues?
+static int
+queued(void)
+{
+  struct runq *rq;
+  int i;
+
+  for(rq = runq; rq < &runq[NCPU]; rq++)
+    for(i = 0; i < NPRIO; i++)
+      if(rq->head[i])
+        return 1;
+  return 0;
+}
+
+// Wait for an interrupt with this CPU's timer stopped, or
+// set for the next sleep() deadline; see timeridle().
+// setrunnable() kicks the CPU if there's work meanwhile.
+static void
+idle(struct cpu *c)
+{
+  // with interrupts off, an interrupt that arrives after the
+  // check below still ends the wfi, but isn't taken until
+  // after it.
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  if(!queued()){
+    timeridle();
+    asm volatile("wfi");
   }
+  c->idle = 0;
+  timerresume();
+  intr_on();
 }
 
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
-// Scheduler never returns.  It loops, doing:
+//  - take a process off a run queue.
 //  - choose a process to run.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
@@ -460,35 +1099,47 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
+  int i;
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
-      intr_on();
-      asm volatile("wfi");
+
+    // this CPU's queue first, then anyone else's.
+    p = dequeue(&runq[id]);
+    for(i = 1; p == 0 && i < NCPU; i++)
+      p = dequeue(&runq[(id + i) % NCPU]);
+    if(p == 0){
+      // nothing to run; zero free pages, or rest.
+      if(kzerofill() == 0)
+        idle(c);
+      continue;
     }
+
+    // p may still be on its way out of the CPU that
+    // queued it, in yield(); the lock waits for that.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: queued");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    kvmswitch(p);
+    swtch(&c->context, &p->context);
+
+    // back to the kernel's own page table before
+    // releasing p->lock lets wait() free p's.
+    kvmswitch(0);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -525,7 +1176,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -551,19 +1202,35 @@ forkret(void)
   usertrapret();
 }
 
+// Take p off sleep queue q.
+// Caller must hold q->lock.
+static void
+sqremove(struct sleepq *q, struct proc *p)
+{
+  if(p->sqprev)
+    p->sqprev->sqnext = p->sqnext;
+  else
+    q->head = p->sqnext;
+  if(p->sqnext)
+    p->sqnext->sqprev = p->sqprev;
+  p->sq = 0;
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct sleepq *q = SLEEPQ(chan);
   
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Must acquire q->lock and p->lock in order to
+  // join q, change p->state, and then call sched.
+  // Once we hold q->lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks q->lock),
   // so it's okay to release lk.
+  acquire(&q->lock);
   if(lk != &p->lock){  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
     release(lk);
@@ -572,17 +1239,27 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->sq = q;
+  p->sqprev = 0;
+  p->sqnext = q->head;
+  if(q->head)
+    q->head->sqprev = p;
+  q->head = p;
+  release(&q->lock);
 
   sched();
 
-  // Tidy up.
+  // Tidy up. wakeup() takes p off q, but kill()
+  // leaves that to p.
+  release(&p->lock);
+  acquire(&q->lock);
+  if(p->sq)
+    sqremove(q, p);
   p->chan = 0;
+  release(&q->lock);
 
   // Reacquire original lock.
-  if(lk != &p->lock){
-    release(&p->lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
@@ -590,51 +1267,60 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct sleepq *q = SLEEPQ(chan);
+  struct proc *p, *next;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  acquire(&q->lock);
+  for(p = q->head; p; p = next){
+    next = p->sqnext;
+    if(p->chan != chan)
+      continue;
     acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
-    }
+    if(p->state == SLEEPING)
+      setrunnable(p);
     release(&p->lock);
+    sqremove(q, p);
   }
+  release(&q->lock);
 }
 
-// Wake up p if it is sleeping in wait(); used by exit().
-// Caller must hold p->lock.
-static void
-wakeup1(struct proc *p)
-{
-  if(!holding(&p->lock))
-    panic("wakeup1");
-  if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
-  }
-}
-
-// Kill the process with the given pid.
+// Kill the process with the given pid, or whose
+// thread has it, and all the process's threads.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
 int
 kill(int pid)
 {
-  struct proc *p;
+  struct proc *p, *l;
 
-  for(p = proc; p < &proc[NPROC]; p++){
+  if(pid <= 0)
+    return -1;
+  // wait_lock keeps the leader and its threads.
+  acquire(&wait_lock);
+  if((p = findproc(pid)) == 0){
+    release(&wait_lock);
+    return -1;
+  }
+  acquire(&p->lock);
+  if(p->pid != pid){
+    // it exited meanwhile.
+    release(&p->lock);
+    release(&wait_lock);
+    return -1;
+  }
+  l = p->leader;
+  release(&p->lock);
+
+  acquire(&l->lock);
+  setkilled(l);
+  release(&l->lock);
+  for(p = l->threads; p; p = p->thrnext){
     acquire(&p->lock);
-    if(p->pid == pid){
-      p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
-      release(&p->lock);
-      return 0;
-    }
+    setkilled(p);
     release(&p->lock);
   }
-  return -1;
+  release(&wait_lock);
+  return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -675,6 +1361,7 @@ procdump(void)
 {
   static char *states[] = {
   [UNUSED]    "unused",
+  [USED]      "used  ",
   [SLEEPING]  "sleep ",
   [RUNNABLE]  "runble",
   [RUNNING]   "run   ",
@@ -682,16 +1369,18 @@ procdump(void)
   };
   struct proc *p;
   char *state;
+  int i;
 
   printf("\n");
-  for(p = proc; p < &proc[NPROC]; p++){
+  for(i = 0; i < nproc; i++){
+    p = proc[i];
     if(p->state == UNUSED)
       continue;
     if(p->state >= 0 && p->state < NELEM(states) && states[p->state])
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %d %s", p->pid, state, p->prio, p->name);
     printf("\n");
   }
 }
@@ -702,7 +1391,8 @@ getnfreeproc(void)
     int cnt = 0;
 
     struct proc *p;
-    for(p = proc; p < &proc[NPROC]; p++) {
+    for(int i = 0; i < nproc; i++) {
+        p = proc[i];
         acquire(&p->lock);
         if(p->state != UNUSED) {
             cnt++;
@@ -24,13 +24,19 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  uint64 asidgen;             // ASID generation of this cpu's TLB; see kvmswitch()
+  int idle;                   // In wfi, with its timer stopped; see idle()
+  uint tick;                  // ticks when timeslice() last charged one
+  uint64 asid;                // ASID the running process uses here; see kvmswitch()
+  int tlbflush;               // Asked to flush its TLB; see tlbshoot() in vm.c
 };
 
 extern struct cpu cpus[NCPU];
 
 // per-process data for the trap handling code in trampoline.S.
 // sits in a page by itself just under the trampoline page in the
-// user page table. not specially mapped in the kernel page table.
+// user page table, or lower down for a thread; see TTRAPFRAME.
+// not specially mapped in the kernel page table.
 // the sscratch register points here.
 // uservec in trampoline.S saves user registers in the trapframe,
 // then initializes registers from the trapframe's
@@ -80,7 +86,34 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
-enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+// a loadable segment of a program, read in from the
+// executable a page at a time as the program touches it.
+struct seg {
+  uint64 va;                   // page-aligned start
+  uint64 filesz;               // bytes from the file; the rest are zero
+  uint off;                    // offset of va in the file
+  int perm;                    // PTE_R, PTE_W and PTE_X for the pages
+};
+
+// a region of memory mapped by mmap().
+struct vma {
+  uint64 start;                // page-aligned
+  uint64 end;                  // 0 if the slot is free
+  int prot;                    // PROT_READ etc.
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct file *f;              // mapped file, or 0 if anonymous
+  uint64 off;                  // offset of start in f
+};
+
+enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
+
+// Open files and current directory, shared by a process's threads
+struct fdtable {
+  struct spinlock lock;        // protects everything below
+  int ref;                     // threads using the table
+  struct file *ofile[NOFILE];  // Open files
+  struct inode *cwd;           // Current directory
+};
 
 // Per-process state
 struct proc {
@@ -88,21 +121,65 @@ struct proc {
 
   // p->lock must be held when using these:
   enum procstate state;        // Process state
-  struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
+  // wait_lock must be held when using these:
+  struct proc *parent;         // Parent process
+  struct proc *children;       // First child
+  struct proc *sibprev;        // Neighbours in parent's children
+  struct proc *sibnext;
+  struct proc *threads;        // A leader's other threads; see clone()
+  struct proc *thrprev;        // Neighbours in the leader's threads
+  struct proc *thrnext;
+
+  // wait_lock and the leader's p->lock must be held to change
+  // this, and either to use it:
+  int nthread;                 // A leader's threads, counting itself; 0 in a thread
+
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // Next in its pidhash[] chain
+
+  // the threads of a process share its memory, which is
+  // described by the fields of its leader, the thread that
+  // started it: sz, asid, asidgen, tlbcpus, exe, seg, nseg and
+  // vma. vmlock protects the user page table and sz.
+  struct spinlock vmlock;
 
   // these are private to the process, so p->lock need not be held.
-  uint64 kstack;               // Virtual address of kernel stack
+  int slot;                    // Index in proc[]; see KSTACK()
+  uint64 kstack;               // Virtual address of kernel stack, or 0
+  struct proc *leader;         // Thread whose memory this one uses; maybe p itself
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
+  pagetable_t kpagetable;      // Kernel page table, with user memory too
+  uint64 asid;                 // Address-space ID of both page tables
+  uint64 asidgen;              // Generation asid belongs to
+  uint64 tlbcpus;              // CPUs whose TLBs are up to date for asid
+  int lastcpu;                 // CPU that last ran this process, or -1
+  int noswap;                  // If non-zero, swapout() leaves this process alone
+  struct proc *rqnext;         // Next on its run queue; see setrunnable()
+  struct sleepq *sq;           // Sleep queue p is on, or 0; see sleep()
+  struct proc *sqprev;         // Neighbours on it
+  struct proc *sqnext;
+  int prio;                    // Scheduling priority, 0 highest
+  int nice;                    // Priority after a boost; see nice()
+  int slice;                   // Ticks run at prio; see timeslice()
+  uint boosts;                 // Value of boosts when prio was last reset
+  uint64 twhen;                // Deadline of sleepuntil(), in mtime cycles
+  struct proc *tnext;          // Next in its timer wheel slot
+  int tpending;                // Still in the timer wheel?
   struct trapframe *trapframe; // data page for trampoline.S
+  uint64 trapva;               // where it is in the user page table
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct fdtable *fdt;         // Open files and current directory
+  struct file *fdref;          // argfd()'s reference, until the system call returns
+  struct inode *exe;           // Executable, for demand paging
+  struct seg seg[NSEG];        // Program segments backed by exe
+  int nseg;
+  struct vma vma[NVMA];        // Regions mapped by mmap()
   char name[16];               // Process name (debugging)
   int mask;
 };
@@ -0,0 +1,227 @@
+// Slab allocator for small fixed-size kernel objects.
+//
+// A kmem_cache hands out objects of one size, carved out of
+// whole pages from kalloc() called slabs. Each slab starts
+// with a struct slab header, followed by as many objects as
+// fit; its free objects are linked through their first word.
+// Slabs with free objects sit on the cache's partial list,
+// full slabs are on no list, and a slab whose objects have
+// all been freed goes straight back to kalloc().
+//
+// In front of the slabs, each CPU has a magazine of free
+// objects. kmem_cache_alloc() and kmem_cache_free() usually
+// only touch their own CPU's magazine, and move objects
+// to and from the slabs MAGSIZE/2 at a time.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;        // on cache's partial list
+  struct slab *prev;
+  void *freelist;           // free objects in this slab
+  uint inuse;               // objects allocated from this slab
+};
+
+#define SLABHDR ((sizeof(struct slab) + 15) & ~15)
+
+// list of all caches, for kmem_reap() and kmem_cache_dump().
+// only changed at boot, by kmem_cache_init().
+static struct kmem_cache *caches;
+
+// Set up cache c for objects of size bytes.
+// Must be called at boot, before c is used.
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  c->name = name;
+  c->size = (size + 15) & ~15;
+  if(c->size < sizeof(void*) || SLABHDR + c->size > PGSIZE)
+    panic("kmem_cache_init");
+  c->nperslab = (PGSIZE - SLABHDR) / c->size;
+  c->partial = 0;
+  c->nslab = 0;
+  c->nalloc = 0;
+  for(int i = 0; i < NCPU; i++){
+    initlock(&c->mag[i].lock, name);
+    c->mag[i].n = 0;
+  }
+  c->next = caches;
+  caches = c;
+}
+
+static void
+partial_push(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+partial_remove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+// Allocate and carve up a new slab page, and put it
+// on the partial list. Caller must hold c->lock.
+static struct slab*
+slab_grow(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->cache = c;
+  s->freelist = 0;
+  s->inuse = 0;
+  for(uint i = 0; i < c->nperslab; i++){
+    obj = (char*)s + SLABHDR + i*c->size;
+    *(void**)obj = s->freelist;
+    s->freelist = obj;
+  }
+  partial_push(c, s);
+  c->nslab++;
+  return s;
+}
+
+// Take up to n objects from the slabs into objs[].
+// Returns the number of objects taken.
+static int
+slab_getn(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s;
+  int i;
+
+  acquire(&c->lock);
+  for(i = 0; i < n; i++){
+    if((s = c->partial) == 0 && (s = slab_grow(c)) == 0)
+      break;
+    objs[i] = s->freelist;
+    s->freelist = *(void**)objs[i];
+    s->inuse++;
+    if(s->freelist == 0)
+      partial_remove(c, s);
+  }
+  c->nalloc += i;
+  release(&c->lock);
+  return i;
+}
+
+// Return n objects in objs[] to their slabs, freeing
+// any slab that ends up with no objects in use.
+static void
+slab_putn(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s;
+
+  acquire(&c->lock);
+  for(int i = 0; i < n; i++){
+    s = (struct slab*)PGROUNDDOWN((uint64)objs[i]);
+    if(s->cache != c || s->inuse == 0)
+      panic("kmem_cache_free");
+    if(s->freelist == 0)
+      partial_push(c, s);
+    *(void**)objs[i] = s->freelist;
+    s->freelist = objs[i];
+    if(--s->inuse == 0){
+      partial_remove(c, s);
+      kfree((void*)s);
+      c->nslab--;
+    }
+  }
+  c->nalloc -= n;
+  release(&c->lock);
+}
+
+// Allocate an object from cache c.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *obj = 0;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == 0)
+    m->n = slab_getn(c, m->obj, MAGSIZE/2);
+  if(m->n > 0)
+    obj = m->obj[--m->n];
+  release(&m->lock);
+  pop_off();
+  return obj;
+}
+
+// Free an object that kmem_cache_alloc(c) returned.
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  struct magazine *m;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    slab_putn(c, &m->obj[MAGSIZE/2], MAGSIZE/2);
+    m->n = MAGSIZE/2;
+  }
+  m->obj[m->n++] = obj;
+  release(&m->lock);
+  pop_off();
+}
+
+// Empty every CPU's magazines back into the slabs, so
+// that slabs with no objects in use go back to kalloc().
+// Used when memory runs short.
+// Returns the number of pages freed.
+int
+kmem_reap(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+  uint64 nslab;
+  int freed = 0;
+
+  for(c = caches; c; c = c->next){
+    nslab = c->nslab;
+    for(m = c->mag; m < &c->mag[NCPU]; m++){
+      acquire(&m->lock);
+      slab_putn(c, m->obj, m->n);
+      m->n = 0;
+      release(&m->lock);
+    }
+    freed += nslab - c->nslab;
+  }
+  return freed;
+}
+
+// Print each cache's objects and slab pages.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmem_cache_dump(void)
+{
+  struct kmem_cache *c;
+
+  for(c = caches; c; c = c->next)
+    printf("cache %s: %d objects of %d bytes in %d slabs\n",
+           c->name, (int)c->nalloc, c->size, (int)c->nslab);
+}
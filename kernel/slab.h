@@ -0,0 +1,24 @@
+// Object caches for small fixed-size kernel objects.
+// See slab.c.
+
+#define MAGSIZE 16  // objects held by each per-CPU magazine
+
+// a per-CPU stack of free objects, so that most allocations
+// and frees never touch the cache's shared slab lists.
+struct magazine {
+  struct spinlock lock;
+  int n;                    // number of objects in obj[]
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  struct spinlock lock;     // protects the slab lists and counts
+  char *name;
+  uint size;                // object size, rounded up for alignment
+  uint nperslab;            // objects in each slab page
+  struct slab *partial;     // slabs with both free and used objects
+  uint64 nslab;             // slab pages allocated
+  uint64 nalloc;            // objects handed out of slabs
+  struct kmem_cache *next;  // on list of all caches
+  struct magazine mag[NCPU];
+};
@@ -0,0 +1,299 @@
+//
+// Swapping user pages out to disk when memory runs short.
+//
+// mkfs leaves a swap area after the file system, described by
+// sb.swapstart and sb.nswap, divided into page-sized slots.
+// When growproc() or a page fault finds no free memory,
+// swapout() evicts pages that processes haven't used lately,
+// chosen with a clock sweep over PTE_A, and writes them to
+// free slots. An evicted page's PTE loses PTE_V, gains PTE_SWAP,
+// and records the slot where the physical page number was; the
+// next fault on it reads it back with swapin(). fork() shares
+// slots between parent and child, so each slot has a count.
+//
+// Only private, writable pages below p->sz are evicted: the
+// heap, the stack, and program data that has been written.
+// Pages shared with other processes or read from files are
+// left alone, and so are the pages of a process with more
+// than one thread, which another CPU may be using. A
+// swapped-out page has no reservation (see kreserve()), since
+// swapin() allocates the memory it needs.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "proc.h"
+
+#define SLOTBLOCKS (PGSIZE / BSIZE)   // disk blocks per slot
+#define NSLOT (SWAPSIZE / SLOTBLOCKS)
+
+// a swapped-out page's PTE holds its slot number
+// where a valid PTE holds the physical page number.
+#define SLOT2PTE(slot) (((uint64)(slot)) << 10)
+#define PTE2SLOT(pte) ((pte) >> 10)
+
+extern struct proc *proc[NPROC];
+extern int nproc;
+
+struct {
+  struct sleeplock lock;  // one swapout() at a time; protects hand and va
+  struct spinlock slock;  // protects ref and nfree
+  uint dev;
+  uint start;             // first block of the swap area
+  int nslot;              // slots in the swap area
+  int nfree;              // free slots
+  ushort ref[NSLOT];      // page tables referring to each slot; up to NPROC
+  int hand;               // clock hand: a process,
+  uint64 va;              // and a page of its memory
+  struct buf buf;         // for disk I/O; buf.lock protects it
+} swap;
+
+void
+swapinit(int dev, struct superblock *sb)
+{
+  initsleeplock(&swap.lock, "swap");
+  initlock(&swap.slock, "swapslot");
+  initsleeplock(&swap.buf.lock, "swapbuf");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslot = sb->nswap / SLOTBLOCKS;
+  if(swap.nslot > NSLOT)
+    swap.nslot = NSLOT;
+  swap.nfree = swap.nslot;
+}
+
+// Allocate a free slot. Returns its number, or -1.
+static int
+slotalloc(void)
+{
+  int i;
+
+  acquire(&swap.slock);
+  for(i = 0; i < swap.nslot; i++){
+    if(swap.ref[i] == 0){
+      swap.ref[i] = 1;
+      swap.nfree--;
+      release(&swap.slock);
+      return i;
+    }
+  }
+  release(&swap.slock);
+  return -1;
+}
+
+// Drop a reference to slot i.
+static void
+slotput(int i)
+{
+  acquire(&swap.slock);
+  if(swap.ref[i] == 0)
+    panic("slotput");
+  if(--swap.ref[i] == 0)
+    swap.nfree++;
+  release(&swap.slock);
+}
+
+// Read (write == 0) or write the page at pa from or to slot i.
+// A page is several disk blocks, each bounced through swap.buf.
+static void
+slotrw(int i, char *pa, int write)
+{
+  struct buf *b = &swap.buf;
+  int j;
+
+  acquiresleep(&b->lock);
+  b->dev = swap.dev;
+  for(j = 0; j < SLOTBLOCKS; j++){
+    b->blockno = swap.start + i*SLOTBLOCKS + j;
+    if(write)
+      memmove(b->data, pa + j*BSIZE, BSIZE);
+    virtio_disk_rw(b, write);
+    if(!write)
+      memmove(pa + j*BSIZE, b->data, BSIZE);
+  }
+  releasesleep(&b->lock);
+}
+
+// Can swapout() take p's pages? Not while p is running on
+// another CPU, nor while it may be in the kernel holding on
+// to a PTE or a page it has faulted in (see p->noswap), nor
+// while it has threads. A thread's memory is its leader's.
+// Caller must hold p->lock.
+static int
+evictable(struct proc *p)
+{
+  if(p->noswap || p->nthread != 1)
+    return 0;
+  return p->state == SLEEPING || p->state == RUNNABLE || p == myproc();
+}
+
+// p's TLB entries for va may be stale after a change to its PTE.
+// Caller must hold p->lock.
+static void
+stale(struct proc *p, uint64 va)
+{
+  if(p == myproc())
+    uvmflush(p->pagetable, va);
+  else
+    p->tlbcpus = 0;  // flush when p next runs; see kvmswitch()
+}
+
+// Look for a page to evict with the clock algorithm: sweep
+// the hand over the user pages of each process, giving any
+// page used since the hand last passed (PTE_A set) a second
+// chance. Gives up after passing every process twice.
+// Returns the page's PTE, with *pp locked and the page's
+// address in *vap, or 0. Caller must hold swap.lock.
+static pte_t*
+sweep(struct proc **pp, uint64 *vap)
+{
+  struct proc *p;
+  pte_t *pte;
+  int i;
+
+  for(i = 0; i <= 2*nproc; i++){
+    if(swap.hand >= nproc)
+      swap.hand = 0;
+    p = proc[swap.hand];
+    acquire(&p->lock);
+    for(; evictable(p) && swap.va < p->sz; swap.va += PGSIZE){
+      if((pte = walk(p->pagetable, swap.va, 0)) == 0){
+        // no page-table page: skip its 2MB.
+        swap.va = (swap.va | (SUPERPGSIZE-1)) + 1 - PGSIZE;
+        continue;
+      }
+      if((*pte & (PTE_V|PTE_U|PTE_W)) != (PTE_V|PTE_U|PTE_W) ||
+         krefcnt((void*)PTE2PA(*pte)) != 1)
+        continue;
+      if(*pte & PTE_A){
+        *pte &= ~PTE_A;
+        stale(p, swap.va);
+        continue;
+      }
+      *pp = p;
+      *vap = swap.va;
+      swap.va += PGSIZE;
+      return pte;
+    }
+    release(&p->lock);
+    swap.hand = (swap.hand + 1) % nproc;
+    swap.va = 0;
+  }
+  return 0;
+}
+
+// Evict n pages to the swap area, to free their memory.
+// Evicts none if the swap area doesn't have room for n.
+// May sleep; caller must hold no spinlocks.
+// Returns the number of pages evicted.
+int
+swapout(uint64 n)
+{
+  struct proc *p;
+  pagetable_t pagetable;
+  pte_t *pte, old;
+  uint64 va, pa;
+  int pid, slot, done = 0;
+
+  if(n == 0 || n > swap.nfree)
+    return 0;
+
+  acquiresleep(&swap.lock);
+  while(done < n && (pte = sweep(&p, &va)) != 0){
+    // write the page out with p->lock released, so p may run
+    // meanwhile; it must not store to the page, or drop it,
+    // before the PTE is replaced below. PTE_D shows a store;
+    // the extra reference keeps pa from being reused.
+    *pte &= ~PTE_D;
+    stale(p, va);
+    old = *pte;
+    pa = PTE2PA(old);
+    pid = p->pid;
+    pagetable = p->pagetable;
+    kdup((void*)pa);
+    release(&p->lock);
+
+    if((slot = slotalloc()) < 0){
+      kfree((void*)pa);
+      break;
+    }
+    slotrw(slot, (char*)pa, 1);
+
+    acquire(&p->lock);
+    if(p->pid == pid && evictable(p) && p->pagetable == pagetable &&
+       (pte = walk(pagetable, va, 0)) != 0 && *pte == old){
+      *pte = SLOT2PTE(slot) | (PTE_FLAGS(old) & ~(PTE_V|PTE_A|PTE_D)) | PTE_SWAP;
+      stale(p, va);
+      kfree((void*)pa);
+      done++;
+    } else {
+      slotput(slot);
+    }
+    release(&p->lock);
+    kfree((void*)pa);
+  }
+  releasesleep(&swap.lock);
+  return done;
+}
+
+// Read the swapped-out page that *pte, in the page table
+// of p, a leader, refers to back into memory, and map it
+// again. Evicts another page if there's no free memory.
+// May sleep.
+// Returns 0 on success, -1 if there's no memory.
+int
+swapin(struct proc *p, pte_t *pte)
+{
+  pte_t old = *pte;
+  int slot = PTE2SLOT(old);
+  char *mem;
+
+  if((mem = kalloc()) == 0 && (swapout(1) == 0 || (mem = kalloc()) == 0))
+    return -1;
+  slotrw(slot, mem, 0);
+  acquire(&p->vmlock);
+  if(*pte == old){
+    *pte = PA2PTE(mem) | (PTE_FLAGS(old) & ~PTE_SWAP) | PTE_V;
+    slotput(slot);
+    mem = 0;
+  }
+  release(&p->vmlock);
+  // otherwise sbrk() has freed the page meanwhile.
+  if(mem)
+    kfree(mem);
+  return 0;
+}
+
+// Add a reference to the slot of a swapped-out PTE,
+// for uvmcopy().
+void
+swapdup(pte_t pte)
+{
+  acquire(&swap.slock);
+  if(++swap.ref[PTE2SLOT(pte)] == 0)
+    panic("swapdup");
+  release(&swap.slock);
+}
+
+// Drop the reference of a swapped-out PTE to its slot,
+// for uvmunmap().
+void
+swapfree(pte_t pte)
+{
+  slotput(PTE2SLOT(pte));
+}
+
+// Print how much of the swap area is in use.
+// Runs when user types ^P on console.
+// No lock to avoid wedging a stuck machine further.
+void
+swapdump(void)
+{
+  printf("swap: %d of %d slots used\n", swap.nslot - swap.nfree, swap.nslot);
+}
@@ -12,7 +12,8 @@ int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz)
+  uint64 sz = p->leader->sz;
+  if(addr >= sz || addr+sizeof(uint64) > sz)
     return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
@@ -106,6 +107,14 @@ extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_trace(void);
 extern uint64 sys_sysinfo(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_kallocsites(void);
+extern uint64 sys_nice(void);
+extern uint64 sys_usleep(void);
+extern uint64 sys_waitpid(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -131,6 +140,14 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_trace]   sys_trace,
 [SYS_sysinfo] sys_sysinfo,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_kallocsites] sys_kallocsites,
+[SYS_nice]    sys_nice,
+[SYS_usleep]  sys_usleep,
+[SYS_waitpid] sys_waitpid,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
 };
 
 static char* syscall_id_2_name[NELEM(syscalls)] = {
@@ -157,6 +174,14 @@ static char* syscall_id_2_name[NELEM(syscalls)] = {
 [SYS_close]   "close",
 [SYS_trace]   "trace",
 [SYS_sysinfo] "sysinfo",
+[SYS_mmap]    "mmap",
+[SYS_munmap]  "munmap",
+[SYS_kallocsites] "kallocsites",
+[SYS_nice]    "nice",
+[SYS_usleep]  "usleep",
+[SYS_waitpid] "waitpid",
+[SYS_clone]   "clone",
+[SYS_join]    "join",
 };
 
 void
@@ -170,6 +195,11 @@ syscall(void)
   num = p->trapframe->a7;
   if(num > 0 && num < total && syscalls[num]) {
     p->trapframe->a0 = syscalls[num]();
+    // see argfd() in sysfile.c.
+    if(p->fdref){
+      fileclose(p->fdref);
+      p->fdref = 0;
+    }
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
@@ -178,7 +208,7 @@ syscall(void)
 
   int mask = p->mask;
   int flag[32];
-  for (int i = 1; i < 31; i++) {
+  for (int i = 1; i < 32; i++) {
     flag[i] = ((mask >> i) & 0x01);
   }
   if (flag[num]) {
@@ -21,4 +21,12 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_trace  22
-#define SYS_sysinfo 23
\ No newline at end of file
+#define SYS_sysinfo 23
+#define SYS_mmap   24
+#define SYS_munmap 25
+#define SYS_kallocsites 26
+#define SYS_nice   27
+#define SYS_usleep 28
+#define SYS_waitpid 29
+#define SYS_clone  30
+#define SYS_join   31
\ No newline at end of file
@@ -18,16 +18,35 @@
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// If other threads share the descriptor table, one may close the
+// descriptor meanwhile, so take a reference to the file, which
+// syscall() drops when the system call returns.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct proc *p = myproc();
+  struct fdtable *t = p->fdt;
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
+  // only this thread could share the table.
+  if(t->ref == 1){
+    if((f = t->ofile[fd]) == 0)
+      return -1;
+  } else {
+    if(p->fdref)
+      panic("argfd");
+    acquire(&t->lock);
+    if((f = t->ofile[fd]) != 0)
+      p->fdref = filedup(f);
+    release(&t->lock);
+    if(f == 0)
+      return -1;
+  }
   if(pfd)
     *pfd = fd;
   if(pf)
@@ -41,17 +60,38 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *p = myproc();
+  struct fdtable *t = myproc()->fdt;
 
+  acquire(&t->lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
+    if(t->ofile[fd] == 0){
+      t->ofile[fd] = f;
+      release(&t->lock);
       return fd;
     }
   }
+  release(&t->lock);
   return -1;
 }
 
+// Remove descriptor fd, if it's still f; another thread may
+// have closed it meanwhile. Returns 0 if it was, or -1.
+// Hands the table's reference to f over to the caller.
+static int
+fdfree(int fd, struct file *f)
+{
+  struct fdtable *t = myproc()->fdt;
+  int r = -1;
+
+  acquire(&t->lock);
+  if(t->ofile[fd] == f){
+    t->ofile[fd] = 0;
+    r = 0;
+  }
+  release(&t->lock);
+  return r;
+}
+
 uint64
 sys_dup(void)
 {
@@ -97,9 +137,8 @@ sys_close(void)
   int fd;
   struct file *f;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argfd(0, &fd, &f) < 0 || fdfree(fd, f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
   fileclose(f);
   return 0;
 }
@@ -322,9 +361,7 @@ sys_open(void)
     return -1;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
-    if(f)
-      fileclose(f);
+  if((f = filealloc()) == 0){
     iunlockput(ip);
     end_op();
     return -1;
@@ -341,6 +378,17 @@ sys_open(void)
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
 
+  // only now that f is ready may other threads see it.
+  if((fd = fdalloc(f)) < 0){
+    // ip's reference is dropped below, not by fileclose().
+    f->type = FD_NONE;
+    f->ip = 0;
+    fileclose(f);
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
   }
@@ -391,8 +439,8 @@ uint64
 sys_chdir(void)
 {
   char path[MAXPATH];
-  struct inode *ip;
-  struct proc *p = myproc();
+  struct inode *ip, *old;
+  struct fdtable *t = myproc()->fdt;
   
   begin_op();
   if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0){
@@ -406,9 +454,12 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(p->cwd);
+  acquire(&t->lock);
+  old = t->cwd;
+  t->cwd = ip;
+  release(&t->lock);
+  iput(old);
   end_op();
-  p->cwd = ip;
   return 0;
 }
 
@@ -468,19 +519,47 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      p->ofile[fd0] = 0;
-    fileclose(rf);
+    // another thread's close() may have beaten us to it.
+    if(fd0 < 0 || fdfree(fd0, rf) == 0)
+      fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
-    fileclose(rf);
-    fileclose(wf);
+    if(fdfree(fd0, rf) == 0)
+      fileclose(rf);
+    if(fdfree(fd1, wf) == 0)
+      fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off;
+  int prot, flags, fd;
+  struct file *f = 0;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(4, &fd) < 0 || argaddr(5, &off) < 0)
+    return -1;
+  // the kernel always chooses the address.
+  if(addr != 0)
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0)
+    return -1;
+  return munmap(addr, len);
+}
@@ -1,4 +1,17 @@
 struct sysinfo {
   uint64 freemem;   // amount of free memory (bytes)
   uint64 nproc;     // number of process
+  uint64 allocmem;  // amount of allocated memory (bytes)
+  uint64 peakmem;   // most memory ever allocated at once (bytes)
+  uint64 nallocfail; // number of failed page allocations
+  uint64 nzeromap;  // pages mapped to the shared zero page
+};
+
+// pages allocated from one place in the kernel, as
+// reported by kallocsites() if the kernel is built
+// with KTRACE=1.
+struct kallocsite {
+  uint64 pc;        // kernel address that called kalloc()
+  int pid;          // process it was called for, or 0
+  int npages;       // pages still allocated
 };
@@ -39,39 +39,69 @@ sys_wait(void)
   return wait(p);
 }
 
+uint64
+sys_waitpid(void)
+{
+  int pid, options;
+  uint64 p;
+
+  if(argint(0, &pid) < 0 || argaddr(1, &p) < 0 || argint(2, &options) < 0)
+    return -1;
+  return waitpid(pid, p, options);
+}
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  if(argaddr(0, &fn) < 0 || argaddr(1, &arg) < 0 || argaddr(2, &stack) < 0)
+    return -1;
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  int tid;
+  uint64 p;
+
+  if(argint(0, &tid) < 0 || argaddr(1, &p) < 0)
+    return -1;
+  return join(tid, p);
+}
+
 uint64
 sys_sbrk(void)
 {
-  int addr;
   int n;
 
   if(argint(0, &n) < 0)
     return -1;
-  addr = myproc()->sz;
-  if(growproc(n) < 0)
-    return -1;
-  return addr;
+  return growproc(n);
 }
 
 uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  // until the n'th tick from now.
+  return sleepuntil((mtime() / INTERVAL + n) * INTERVAL);
+}
+
+// sleep for a number of microseconds, with the precision
+// of the CLINT's clock rather than of ticks.
+uint64
+sys_usleep(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0 || n < 0)
+    return -1;
+  return sleepuntil(mtime() + (uint64)n * (MTIMEHZ / 1000000));
 }
 
 uint64
@@ -84,6 +114,18 @@ sys_kill(void)
   return kill(pid);
 }
 
+// set the scheduling priority the process returns to
+// at each boost; see nice() in proc.c.
+uint64
+sys_nice(void)
+{
+  int n;
+
+  if(argint(0, &n) < 0)
+    return -1;
+  return nice(n);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -119,7 +161,7 @@ sys_sysinfo(void)
         return -1;
 
     struct sysinfo info;
-    info.freemem = knfreemem();
+    kmeminfo(&info);
     info.nproc = getnfreeproc();
 
     struct proc *p = myproc();
@@ -128,4 +170,27 @@ sys_sysinfo(void)
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// Report the pages still allocated from each place in
+// the kernel; see kallocsites() in kalloc.c.
+uint64
+sys_kallocsites(void)
+{
+  int pid, n, nsite;
+  uint64 addr;
+  struct kallocsite *sites;
+
+  if(argint(0, &pid) < 0 || argaddr(1, &addr) < 0 || argint(2, &n) < 0 || n < 0)
+    return -1;
+  if((sites = kalloc()) == 0)
+    return -1;
+  nsite = kallocsites(pid, sites, PGSIZE / sizeof(*sites));
+  if(n > nsite)
+    n = nsite;
+  if(nsite >= 0 &&
+     copyout(myproc()->pagetable, addr, (char*)sites, n * sizeof(*sites)) < 0)
+    n = -1;
+  kfree(sites);
+  return n;
+}
@@ -0,0 +1,139 @@
+//
+// Timers for processes sleeping until a deadline: sleep()
+// and usleep().
+//
+// A sleeping process waits in a hashed timing wheel: a
+// slot for each tick, modulo NWHEEL, holding the processes
+// whose deadlines fall in a tick of that slot. Each clock
+// interrupt looks only at the slots for the ticks since the
+// last one, and wakes only the processes whose deadlines
+// have passed. Deadlines are in cycles of the CLINT's mtime,
+// so they needn't fall on a tick; cpu 0 sets its timer for
+// any that comes before its next tick, and handles them all.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "proc.h"
+
+#define NWHEEL 64
+
+struct {
+  struct spinlock lock;
+  struct proc *slot[NWHEEL];  // sleepers, by tick of p->twhen
+  int n;                      // sleepers in all slots
+  uint64 done;                // deadlines up to this have passed
+} wheel;
+
+void
+wheelinit(void)
+{
+  initlock(&wheel.lock, "wheel");
+  wheel.done = mtime();
+}
+
+// Return the earliest deadline before limit, or limit if
+// there's none. A deadline more than NWHEEL ticks away may
+// be missed; then return the time to look again.
+// Caller must hold wheel.lock.
+static uint64
+next(uint64 limit)
+{
+  struct proc *p;
+  uint64 t, end, best = limit;
+
+  if(wheel.n == 0)
+    return limit;
+  end = wheel.done / INTERVAL + NWHEEL;
+  for(t = wheel.done / INTERVAL; t < end && t * INTERVAL < best; t++)
+    for(p = wheel.slot[t % NWHEEL]; p; p = p->tnext)
+      if(p->twhen < best)
+        best = p->twhen;
+  if(best == limit && end * INTERVAL < limit)
+    best = end * INTERVAL;
+  return best;
+}
+
+// Set cpu 0's timer for the earliest deadline before limit,
+// or for limit. sleepuntil() compares a new deadline with the
+// timer under wheel.lock, so it must be set under it too.
+void
+wheelarm(uint64 limit)
+{
+  acquire(&wheel.lock);
+  *(uint64*)KCLINT_MTIMECMP(0) = next(limit);
+  release(&wheel.lock);
+}
+
+// Sleep until mtime reaches when.
+// Returns 0, or -1 if the process was killed meanwhile.
+int
+sleepuntil(uint64 when)
+{
+  struct proc *p = myproc();
+  struct proc **pp;
+
+  acquire(&wheel.lock);
+  if(when > mtime()){
+    p->twhen = when;
+    p->tnext = wheel.slot[(when / INTERVAL) % NWHEEL];
+    wheel.slot[(when / INTERVAL) % NWHEEL] = p;
+    p->tpending = 1;
+    wheel.n++;
+
+    // cpu 0 may have its timer set for later.
+    if(when < *(uint64*)KCLINT_MTIMECMP(0))
+      kick(0);
+
+    while(p->tpending && !p->killed)
+      sleep(&p->twhen, &wheel.lock);
+
+    if(p->tpending){
+      for(pp = &wheel.slot[(when / INTERVAL) % NWHEEL]; *pp != p; pp = &(*pp)->tnext)
+        ;
+      *pp = p->tnext;
+      p->tpending = 0;
+      wheel.n--;
+    }
+  }
+  release(&wheel.lock);
+  return p->killed ? -1 : 0;
+}
+
+// Wake the processes whose deadlines have passed, and set
+// cpu 0's timer for the next deadline, if it comes before
+// the next tick. Called by clockintr() on cpu 0.
+void
+wheelexpire(void)
+{
+  struct proc *p, **pp;
+  uint64 now, t, last, cmp;
+
+  acquire(&wheel.lock);
+  now = mtime();
+  last = now / INTERVAL;
+  if(last - wheel.done / INTERVAL >= NWHEEL)
+    last = wheel.done / INTERVAL + NWHEEL - 1;
+  for(t = wheel.done / INTERVAL; wheel.n > 0 && t <= last; t++){
+    for(pp = &wheel.slot[t % NWHEEL]; (p = *pp) != 0; ){
+      if(p->twhen <= now){
+        *pp = p->tnext;
+        p->tpending = 0;
+        wheel.n--;
+        wakeup(&p->twhen);
+      } else {
+        pp = &p->tnext;
+      }
+    }
+  }
+  wheel.done = now;
+
+  cmp = *(uint64*)KCLINT_MTIMECMP(0);
+  if((t = next(cmp)) < cmp)
+    *(uint64*)KCLINT_MTIMECMP(0) = t;
+  release(&wheel.lock);
+}
@@ -9,8 +9,16 @@
 struct spinlock tickslock;
 uint ticks;
 
+// ticks counts INTERVALs of the CLINT's mtime since boot,
+// rather than timer interrupts, which idle CPUs skip; see
+// timeridle().
+static uint64 tick0;      // mtime / INTERVAL at boot
+
 extern char trampoline[], uservec[], userret[];
 
+// in ucopy.S.
+extern char ucopystart[], ucopyfault[];
+
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
@@ -20,6 +28,7 @@ void
 trapinit(void)
 {
   initlock(&tickslock, "time");
+  tick0 = mtime() / INTERVAL;
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -29,6 +38,18 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
+// the kind of access that caused a page fault,
+// for uvmfault().
+static int
+access(uint64 scause)
+{
+  if(scause == 12)
+    return PTE_X;
+  if(scause == 15)
+    return PTE_W;
+  return PTE_R;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -65,6 +86,13 @@ usertrap(void)
     intr_on();
 
     syscall();
+
+    // see uvmprefault().
+    p->noswap = 0;
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            uvmfault(p->pagetable, r_stval(), access(r_scause())) == 0){
+    // page fault on lazily allocated, demand-paged
+    // or copy-on-write memory.
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -77,7 +105,7 @@ usertrap(void)
     exit(-1);
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2)
+  if(which_dev == 2 && timeslice())
     yield();
 
   usertrapret();
@@ -119,13 +147,13 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = MAKE_SATP_ASID(p->pagetable, mycpu()->asid);
 
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64,uint64))fn)(p->trapva, satp);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -143,15 +171,28 @@ kerneltrap()
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
 
-  if((which_dev = devintr()) == 0){
+  if((scause == 13 || scause == 15) &&
+     sepc >= (uint64)ucopystart && sepc < (uint64)ucopyfault){
+    // page fault on user memory in copyin() or copyout().
+    // uvmfault() refuses pages without PTE_U, such as the
+    // stack guard page.
+    if(uvmfault(myproc()->pagetable, r_stval(), access(scause)) < 0)
+      sepc = (uint64)ucopyfault;
+  } else if((which_dev = devintr()) == 0){
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
   }
 
   // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+  // swapout() mustn't take pages from a process that was
+  // in the middle of something in the kernel.
+  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING &&
+     timeslice()){
+    myproc()->noswap++;
     yield();
+    myproc()->noswap--;
+  }
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -159,13 +200,76 @@ kerneltrap()
   w_sstatus(sstatus);
 }
 
-void
-clockintr()
+// Bring ticks up to date with mtime, which runs on while
+// every CPU is idle, and boost() if that crossed a boost.
+static void
+tickupdate(void)
 {
+  uint now, then;
+
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  then = ticks;
+  ticks = now = mtime() / INTERVAL - tick0;
   release(&tickslock);
+  if(now / BOOSTTICKS != then / BOOSTTICKS)
+    boost();
+}
+
+void
+clockintr()
+{
+  tickupdate();
+  if(cpuid() == 0)
+    wheelexpire();
+}
+
+// Return the CLINT's cycle counter.
+uint64
+mtime(void)
+{
+  return *(uint64*)KCLINT_MTIME;
+}
+
+// Set this CPU's timer for while it's idle: cpu 0 keeps
+// the next sleep deadline (see timer.c), and the other CPUs
+// need no timer at all, since kick() wakes them when there's
+// work. Interrupts must be off.
+void
+timeridle(void)
+{
+  int id = cpuid();
+  uint64 when = ~0ULL;
+
+  if(id == 0)
+    wheelarm(when);
+  else
+    *(uint64*)KCLINT_MTIMECMP(id) = when;
+}
+
+// Have this CPU's timer tick every INTERVAL again, or
+// sooner on cpu 0 for a sleep deadline. Whatever woke the
+// CPU may use ticks before the next tick, so bring it up
+// to date now.
+// Interrupts must be off.
+void
+timerresume(void)
+{
+  int id = cpuid();
+  uint64 when = mtime() + INTERVAL;
+
+  tickupdate();
+
+  if(id == 0)
+    wheelarm(when);
+  else
+    *(uint64*)KCLINT_MTIMECMP(id) = when;
+}
+
+// Interrupt CPU id, to wake it from wfi.
+void
+kick(int id)
+{
+  *(uint32*)KCLINT_MSIP(id) = 1;
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -202,11 +306,11 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or a kick(), forwarded by timervec in kernelvec.S.
+    // any CPU may be the one whose timer is ticking.
 
-    if(cpuid() == 0){
-      clockintr();
-    }
+    clockintr();
+    tlbpoll();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,18 +13,38 @@
  */
 pagetable_t kernel_pagetable;
 
+// protects mappings added to kernel_pagetable after boot,
+// by kvmalloc() and kvmfree().
+struct spinlock kvmlock;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+// address-space IDs tag TLB entries with the page table they
+// came from, so that switching page tables needn't flush the
+// TLB. a process uses one ASID for both its user and kernel
+// page tables, which map user memory identically, and so do
+// all its threads. ASID 0 is kernel_pagetable's. when the
+// ASIDs run out, a new generation starts, and each CPU flushes
+// its whole TLB before it next runs a process; processes get
+// a fresh ASID when they next run.
+struct {
+  struct spinlock lock;
+  uint64 gen;           // current generation; starts at 1
+  uint64 next;          // next free ASID in this generation
+  uint64 max;           // largest ASID the hardware supports
+} asids;
+
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+
 /*
  * create a direct-map page table for the kernel.
  */
 void
 kvminit()
 {
-  kernel_pagetable = (pagetable_t) kalloc();
-  memset(kernel_pagetable, 0, PGSIZE);
+  kernel_pagetable = (pagetable_t) kalloc_zeroed();
 
   // uart registers
   kvmmap(UART0, UART0, PGSIZE, PTE_R | PTE_W);
@@ -36,6 +58,9 @@ kvminit()
   // PLIC
   kvmmap(PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // the CLINT again, where processes' kernel page tables have it.
+  kvmmap(KCLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -47,15 +72,227 @@ kvminit()
   kvmmap(TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 }
 
+// Count the leaf PTEs at each level of a page table.
+static void
+vmcount(pagetable_t pagetable, int level, int *n)
+{
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(pte & (PTE_R|PTE_W|PTE_X))
+      n[level]++;
+    else if(level > 0)
+      vmcount((pagetable_t)PTE2PA(pte), level-1, n);
+  }
+}
+
+// Print how many superpages and ordinary pages
+// the kernel page table maps.
+// Runs when user types ^P on console.
+void
+kvmdump(void)
+{
+  int n[3] = { 0, 0, 0 };
+
+  vmcount(kernel_pagetable, 2, n);
+  printf("kernel page table: %d superpages, %d pages\n", n[1], n[0]);
+}
+
 // Switch h/w page table register to the kernel's page table,
 // and enable paging.
 void
 kvminithart()
 {
+  if(asids.gen == 0){
+    // first call, on cpu 0 before the others start.
+    initlock(&asids.lock, "asid");
+    initlock(&kvmlock, "kvm");
+    asids.gen = 1;
+    asids.next = 1;
+    // the ASID bits that the hardware implements are
+    // the ones that stick.
+    w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID_MASK);
+    asids.max = (r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT;
+  }
   w_satp(MAKE_SATP(kernel_pagetable));
   sfence_vma();
 }
 
+// Switch this CPU to p's kernel page table, giving p's
+// process an ASID if it doesn't have one from the current
+// generation, and flushing only what the TLB might hold
+// stale. With p == 0, switch back to kernel_pagetable.
+// Caller must hold p->lock, with interrupts off.
+void
+kvmswitch(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct proc *l;
+  int id = cpuid();
+  int flushall;
+
+  if(p == 0){
+    w_satp(MAKE_SATP(kernel_pagetable));
+    return;
+  }
+
+  // another thread may give the process a new ASID while p
+  // runs, so p uses the one in c->asid until it next switches.
+  l = p->leader;
+  acquire(&asids.lock);
+  if(asids.max == 0){
+    // no ASIDs: flush on every switch.
+    l->asid = 0;
+    l->asidgen = asids.gen;
+  } else if(l->asidgen != asids.gen){
+    if(asids.next > asids.max){
+      asids.gen++;
+      asids.next = 1;
+    }
+    l->asid = asids.next++;
+    l->asidgen = asids.gen;
+    l->tlbcpus = 0;
+  }
+  flushall = asids.max == 0 || c->asidgen != asids.gen;
+  c->asidgen = asids.gen;
+  c->asid = l->asid;
+  release(&asids.lock);
+
+  w_satp(MAKE_SATP_ASID(p->kpagetable, c->asid));
+  if(flushall)
+    sfence_vma();
+  else if((l->tlbcpus & (1L << id)) == 0)
+    // the process may have changed its mappings
+    // since this CPU last ran it.
+    sfence_vma_asid(c->asid);
+  __sync_fetch_and_or(&l->tlbcpus, 1L << id);
+  p->lastcpu = id;
+}
+
+// Flush this CPU's TLB if another CPU has asked it to, in
+// tlbshoot(). Called for the kick() that asks, and by
+// acquire() as it spins with interrupts off.
+// Interrupts must be off.
+void
+tlbpoll(void)
+{
+  struct cpu *c = mycpu();
+
+  if(c->tlbflush){
+    sfence_vma();
+    __sync_synchronize();
+    c->tlbflush = 0;
+  }
+}
+
+// The PTEs of pagetable have changed, and this CPU has
+// flushed its TLB entries for them. If pagetable is the
+// running process's, make sure that other CPUs don't use
+// stale entries either: those that aren't running one of
+// its threads flush before they next do (see kvmswitch()),
+// and those that are must flush now, before this returns,
+// so that the caller can free pages that were mapped.
+static void
+tlbshoot(pagetable_t pagetable)
+{
+  struct proc *p = myproc(), *q;
+  uint64 mask = 0;
+  int i, me;
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  p = p->leader;
+
+  push_off();
+  me = cpuid();
+  p->tlbcpus = 1L << me;
+  __sync_synchronize();
+  // only this thread can make a second one.
+  if(p->nthread > 1){
+    for(i = 0; i < NCPU; i++){
+      if(i == me || (q = cpus[i].proc) == 0 || q->leader != p)
+        continue;
+      cpus[i].tlbflush = 1;
+      mask |= 1L << i;
+    }
+    __sync_synchronize();
+    for(i = 0; i < NCPU; i++)
+      if(mask & (1L << i))
+        kick(i);
+    // the others may be waiting for this CPU too.
+    for(i = 0; i < NCPU; i++)
+      while((mask & (1L << i)) && cpus[i].tlbflush)
+        tlbpoll();
+  }
+  pop_off();
+}
+
+// Flush this CPU's TLB entry for va, if pagetable
+// is the running process's.
+static void
+flushlocal(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable){
+    push_off();
+    sfence_vma_page(va, mycpu()->asid);
+    pop_off();
+  }
+}
+
+// Flush the TLB entries for va in pagetable,
+// on every CPU that may hold them.
+void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  flushlocal(pagetable, va);
+  tlbshoot(pagetable);
+}
+
+// Flush all the TLB entries for pagetable,
+// on every CPU that may hold them.
+void
+uvmflushall(pagetable_t pagetable)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable){
+    push_off();
+    sfence_vma_asid(mycpu()->asid);
+    pop_off();
+  }
+  tlbshoot(pagetable);
+}
+
+// Make a process's kernel page table: the kernel's mappings,
+// plus the user mappings below MMAPTOP of its user page table,
+// so that copyin() and friends can use user addresses as they
+// are. Only the root page is the process's own; the rest is
+// shared with kernel_pagetable and with the user page table,
+// which keeps the user mappings up to date for free. So the
+// kernel must not add mappings at the root level after boot.
+pagetable_t
+kvmcreate(pagetable_t pagetable)
+{
+  pagetable_t kpagetable;
+
+  if((kpagetable = (pagetable_t)kalloc()) == 0)
+    return 0;
+  memmove(kpagetable, kernel_pagetable, PGSIZE);
+  kvmsetuser(kpagetable, pagetable);
+  return kpagetable;
+}
+
+// Point kpagetable at the user mappings of pagetable,
+// as when exec() replaces a process's user page table.
+void
+kvmsetuser(pagetable_t kpagetable, pagetable_t pagetable)
+{
+  kpagetable[0] = pagetable[0];
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -68,24 +305,36 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A PTE at level 1 may itself be a leaf, mapping a
+// 2-megabyte superpage; walk() then returns that PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE at the given level
+// rather than level 0, or a leaf PTE above that level.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int target)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > target; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(target, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -121,6 +370,51 @@ kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// Map a new page of memory at va in the kernel page table,
+// as for a process's kernel stack. va must lie under a
+// root-level entry that existed at boot, so that processes'
+// kernel page tables see the mapping too; see kvmcreate().
+// Returns 0, or -1 if there's no memory.
+int
+kvmalloc(uint64 va)
+{
+  char *mem;
+  int r = 0;
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  acquire(&kvmlock);
+  if(mappages(kernel_pagetable, va, PGSIZE, (uint64)mem, PTE_R | PTE_W) != 0){
+    kfree(mem);
+    r = -1;
+  }
+  release(&kvmlock);
+  return r;
+}
+
+// Unmap and free the page that kvmalloc() mapped at va.
+// Any CPU may have the mapping in its TLB, under any ASID,
+// so start a new ASID generation: each CPU then flushes
+// its whole TLB before it next runs a process, which is
+// soon enough as long as only one process uses va.
+void
+kvmfree(uint64 va)
+{
+  pte_t *pte;
+
+  acquire(&kvmlock);
+  if((pte = walk(kernel_pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+    panic("kvmfree");
+  kfree((void*)PTE2PA(*pte));
+  *pte = 0;
+  release(&kvmlock);
+
+  acquire(&asids.lock);
+  asids.gen++;
+  asids.next = 1;
+  release(&asids.lock);
+}
+
 // translate a kernel virtual address to
 // a physical address. only needed for
 // addresses on the stack.
@@ -131,7 +425,11 @@ kvmpa(uint64 va)
   uint64 off = va % PGSIZE;
   pte_t *pte;
   uint64 pa;
-  
+
+  pte = walklevel(kernel_pagetable, va, 0, 1);
+  if(pte && (*pte & PTE_V) && (*pte & (PTE_R|PTE_W|PTE_X)))
+    return PTE2PA(*pte) + va % SUPERPGSIZE;
+
   pte = walk(kernel_pagetable, va, 0);
   if(pte == 0)
     panic("kvmpa");
@@ -143,7 +441,9 @@ kvmpa(uint64 va)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Kernel (non-PTE_U) mappings use a single
+// level-1 superpage PTE for each aligned 2-megabyte run.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
@@ -154,6 +454,19 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
+    if((perm & PTE_U) == 0 && a % SUPERPGSIZE == 0 && pa % SUPERPGSIZE == 0 &&
+       last - a >= SUPERPGSIZE - PGSIZE){
+      if((pte = walklevel(pagetable, a, 1, 1)) == 0)
+        return -1;
+      if(*pte & PTE_V)
+        panic("remap");
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      if(last - a == SUPERPGSIZE - PGSIZE)
+        break;
+      a += SUPERPGSIZE;
+      pa += SUPERPGSIZE;
+      continue;
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
@@ -167,31 +480,67 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   return 0;
 }
 
+// Free pages that uvmunmap() has unmapped from pagetable,
+// once no CPU's TLB can still refer to them.
+static void
+freebatch(pagetable_t pagetable, uint64 *pa, int n)
+{
+  int i;
+
+  tlbshoot(pagetable);
+  for(i = 0; i < n; i++){
+    // untouched memory that has only been read.
+    if((void*)pa[i] == kzeropage())
+      kunreserve(1);
+    kfree((void*)pa[i]);
+  }
+}
+
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages that aren't mapped are skipped; they
+// are memory that sbrk() reserved but nothing has touched,
+// or pages in the swap area. Optionally free the physical
+// memory and swap slots, and give back the reservations of
+// the untouched pages, including those mapped to the zero
+// page.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
-  uint64 a;
+  uint64 a, batch[16];
   pte_t *pte;
+  int n = 0, unmapped = 0;
 
   if((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0){
+      if(pte && (*pte & PTE_SWAP)){
+        if(do_free)
+          swapfree(*pte);
+        *pte = 0;
+      } else if(do_free){
+        kunreserve(1);
+      }
+      continue;
+    }
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    uint64 pa = PTE2PA(*pte);
+    *pte = 0;
+    flushlocal(pagetable, a);
+    unmapped = 1;
+    // other CPUs flush once for a batch of pages.
     if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
+      batch[n++] = pa;
+      if(n == NELEM(batch)){
+        freebatch(pagetable, batch, n);
+        n = unmapped = 0;
+      }
     }
-    *pte = 0;
   }
+  if(unmapped)
+    freebatch(pagetable, batch, n);
 }
 
 // create an empty user page table.
@@ -199,11 +548,24 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 pagetable_t
 uvmcreate()
 {
-  pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable_t pagetable, l1, kl1;
+  int i;
+
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
+
+  // the process's kernel page table shares the level-1 page
+  // for the first gigabyte, so that page needs the kernel's
+  // device mappings from MMAPTOP up, without PTE_U.
+  if((l1 = (pagetable_t) kalloc_zeroed()) == 0){
+    kfree(pagetable);
+    return 0;
+  }
+  kl1 = (pagetable_t)PTE2PA(kernel_pagetable[0]);
+  for(i = PX(1, MMAPTOP); i < 512; i++)
+    l1[i] = kl1[i];
+  pagetable[0] = PA2PTE(l1) | PTE_V;
   return pagetable;
 }
 
@@ -217,8 +579,7 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
-  memset(mem, 0, PGSIZE);
+  mem = kalloc_zeroed();
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
   memmove(mem, src, sz);
 }
@@ -236,12 +597,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -294,40 +654,66 @@ freewalk(pagetable_t pagetable)
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
+  pagetable_t l1;
+  int i;
+
   if(sz > 0)
     uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+
+  // the device mappings belong to kernel_pagetable.
+  l1 = (pagetable_t)PTE2PA(pagetable[0]);
+  for(i = PX(1, MMAPTOP); i < 512; i++)
+    l1[i] = 0;
   freewalk(pagetable);
 }
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies only the page table: parent and child
+// share the physical pages, with writable pages
+// made read-only and marked PTE_COW in both, to
+// be copied by cowfault() on the first store.
+// Pages the parent hasn't touched yet stay unmapped
+// in the child too, with a reservation of their own,
+// as do pages mapped to the zero page; pages in the
+// swap area share the parent's slot.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 {
-  pte_t *pte;
+  pte_t *pte, *npte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) != 0 && (*pte & PTE_SWAP)){
+      if((npte = walk(new, i, 1)) == 0)
+        goto err;
+      *npte = *pte;
+      swapdup(*pte);
+      continue;
+    }
+    if(pte == 0 || (*pte & PTE_V) == 0){
+      if(kreserve(1) < 0)
+        goto err;
+      continue;
+    }
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if((void*)pa == kzeropage() && kreserve(1) < 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0){
+      if((void*)pa == kzeropage())
+        kunreserve(1);
       goto err;
     }
+    kdup((void*)pa);
   }
+  // old's PTEs lost PTE_W.
+  uvmflushall(old);
   return 0;
 
  err:
@@ -337,6 +723,9 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
 
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
+// loads and stores by the kernel fault too, since it
+// reaches user memory through the same PTEs; see
+// direct(). PTE_X alone keeps it a leaf.
 void
 uvmclear(pagetable_t pagetable, uint64 va)
 {
@@ -345,7 +734,255 @@ uvmclear(pagetable_t pagetable, uint64 va)
   pte = walk(pagetable, va, 0);
   if(pte == 0)
     panic("uvmclear");
-  *pte &= ~PTE_U;
+  *pte &= ~(PTE_U|PTE_R|PTE_W);
+  uvmflush(pagetable, va);
+}
+
+// Give the process its own writable copy of the
+// copy-on-write page that pte maps at va, after a store
+// to it. If no other process shares the page any more,
+// just make it writable again.
+// Caller must hold the process's vmlock.
+// Returns 0 on success, -1 if there's no memory for the copy.
+static int
+cowfault(pagetable_t pagetable, uint64 va, pte_t *pte)
+{
+  uint64 pa;
+  uint flags;
+  char *mem;
+  int zero;
+
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  zero = (void*)pa == kzeropage();
+  if(zero)
+    mem = kalloc_zeroed();
+  else if((mem = kalloc()) != 0)
+    memmove(mem, (char*)pa, PGSIZE);
+  if(mem == 0)
+    return -1;
+  *pte = PA2PTE(mem) | flags;
+  // other threads may still be reading the old page.
+  uvmflush(pagetable, va);
+  kfree((void*)pa);
+  // the first store to untouched memory uses
+  // up its reservation; see uvmfault().
+  if(zero)
+    kunreserve(1);
+  return 0;
+}
+
+// Map the page pa at va in the memory of p, a leader, with
+// permissions perm, for a fault that has filled it in, unless
+// another thread has mapped va meanwhile, or sbrk() has freed
+// it. Returns 0 if it did, 1 if not, and then the caller
+// should free pa, or -1 if there's no memory.
+int
+uvmfill(struct proc *p, uint64 va, uint64 pa, int perm)
+{
+  pte_t *pte;
+  int r = 1;
+
+  acquire(&p->vmlock);
+  if(va < p->sz || va >= mmapbase(p)){
+    if((pte = walk(p->pagetable, va, 1)) == 0)
+      r = -1;
+    else if((*pte & (PTE_V|PTE_SWAP)) == 0){
+      *pte = PA2PTE(pa) | perm | PTE_V;
+      r = 0;
+    }
+  }
+  release(&p->vmlock);
+  return r;
+}
+
+// Handle a page fault at user virtual address va in the
+// current process, for an access (PTE_R, PTE_W or PTE_X):
+// a store to a copy-on-write page, or the first touch of
+// a page of memory that sbrk() or exec() reserved but didn't
+// allocate, or that mmap() mapped, including the user stack
+// below the page that exec() allocates. exec()'s pages are
+// read in from the program file. Or the first touch of a
+// page that swapout() evicted. Or a page that another thread
+// has just dealt with.
+// Also used by the copy routines below, for the same kinds
+// of pages.
+// Returns 0 if the access can now go ahead, -1 if it was
+// bad or there's no memory, and the process should die.
+int
+uvmfault(pagetable_t pagetable, uint64 va, int access)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+  int held, cow, alloc, retry = 1, r = -1;
+
+  if(va >= MAXVA || p == 0 || pagetable != p->pagetable)
+    return -1;
+  va = PGROUNDDOWN(va);
+  // a thread's memory is its leader's.
+  p = p->leader;
+
+  // reading a file or the swap area sleeps, which mustn't
+  // happen with a spinlock held; see uvmprefault().
+  push_off();
+  held = mycpu()->noff > 1;
+  pop_off();
+
+ again:
+  acquire(&p->vmlock);
+  // a page that may be filled in below needs its page-table
+  // pages; allocate them now, while a shortage of memory
+  // can still be met by swapping out.
+  alloc = va < p->sz || va >= mmapbase(p);
+  if((pte = walk(pagetable, va, alloc)) == 0 && alloc){
+    release(&p->vmlock);
+    if(!held && retry && swapout(1) > 0){
+      retry = 0;
+      goto again;
+    }
+    return -1;
+  }
+  if(pte && (*pte & PTE_V)){
+    cow = 0;
+    if((*pte & (PTE_U|access)) == (PTE_U|access)){
+      r = 0;
+    } else if(access == PTE_W && (*pte & (PTE_U|PTE_COW)) == (PTE_U|PTE_COW)){
+      cow = 1;
+      r = cowfault(pagetable, va, pte);
+    }
+    release(&p->vmlock);
+    if(r < 0 && cow && !held && retry && swapout(1) > 0){
+      retry = 0;
+      goto again;
+    }
+    goto out;
+  }
+  release(&p->vmlock);
+
+  if(pte && (*pte & PTE_SWAP)){
+    if(!held)
+      r = swapin(p, pte);
+    goto out;
+  }
+  if(held && (segbacked(p, va) || mmapbacked(p, va)))
+    return -1;
+  if(va >= p->sz){
+    r = mmapfault(p, va, access == PTE_W);
+  } else if(segbacked(p, va)){
+    r = segload(p, va);
+  } else if(access != PTE_W){
+    // reading untouched memory maps the shared zero page,
+    // copy-on-write; the reservation stays until a store.
+    kdup(kzeropage());
+    if((r = uvmfill(p, va, (uint64)kzeropage(), PTE_X|PTE_R|PTE_U|PTE_COW)) != 0){
+      kfree(kzeropage());
+      r = r < 0 ? -1 : 0;
+    }
+  } else {
+    if((mem = kalloc_zeroed()) == 0 && !held && swapout(1) > 0)
+      mem = kalloc_zeroed();
+    if(mem && (r = uvmfill(p, va, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U)) == 0){
+      kunreserve(1);
+    } else if(mem){
+      kfree(mem);
+      r = r < 0 ? -1 : 0;
+    }
+  }
+
+ out:
+  // the TLB may still hold the old PTE; the trampoline
+  // no longer flushes it on the way back to user space.
+  if(r == 0)
+    flushlocal(pagetable, va);
+  return r;
+}
+
+// Fault in the pages of [va, va+len) that have yet to be
+// read from a file or the swap area, for callers that go on
+// to copy to or from them with a spinlock held, when
+// uvmfault() can't sleep. Keeps swapout() from evicting
+// them again until the system call returns.
+void
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a, end;
+  pte_t *pte;
+
+  p->noswap++;
+  p = p->leader;
+  end = va + len;
+  if(end < va || end > MMAPTOP)
+    end = MMAPTOP;
+  for(a = PGROUNDDOWN(va); a < end; a += PGSIZE){
+    // skip the unmapped gap above the heap.
+    if(a >= p->sz && a < mmapbase(p))
+      a = mmapbase(p);
+    if(a >= end)
+      break;
+    pte = walk(pagetable, a, 0);
+    if(pte && (*pte & PTE_V))
+      continue;
+    if((pte && (*pte & PTE_SWAP)) || segbacked(p, a) || mmapbacked(p, a))
+      uvmfault(pagetable, a, PTE_R);
+  }
+}
+
+// Return the physical address of the user page at va, for
+// copyout() (write != 0) or copyin(), faulting it in first
+// if it hasn't been touched yet or is copy-on-write.
+// Returns 0 if va isn't a valid user address.
+static uint64
+copyaddr(pagetable_t pagetable, uint64 va, int write)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW))){
+    if(uvmfault(pagetable, va, write ? PTE_W : PTE_R) < 0)
+      return 0;
+    // another thread may have freed the page again.
+    if((pte = walk(pagetable, va, 0)) == 0 || (*pte & PTE_V) == 0)
+      return 0;
+  }
+  if((*pte & PTE_U) == 0)
+    return 0;
+  return PTE2PA(*pte);
+}
+
+// Can a copy to or from [va, va+len) in pagetable use the
+// addresses directly? Only for the current process, whose
+// kernel page table maps its memory below MMAPTOP. Pages
+// the copy mustn't touch, such as the stack guard page,
+// fault, and uvmfault() refuses them.
+static int
+direct(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+
+  return p != 0 && pagetable == p->pagetable &&
+    va < MMAPTOP && len <= MMAPTOP - va;
+}
+
+// Run a ucopy.S routine with user memory accessible.
+static int
+ucall(int (*fn)(char*, char*, uint64), char *dst, char *src, uint64 n)
+{
+  int r;
+
+  w_sstatus(r_sstatus() | SSTATUS_SUM);
+  r = fn(dst, src, n);
+  w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+  return r;
 }
 
 // Copy from kernel to user.
@@ -356,9 +993,12 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(direct(pagetable, dstva, len))
+    return ucall(ucopy, (char*)dstva, src, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = copyaddr(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -381,9 +1021,12 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
 
+  if(direct(pagetable, srcva, len))
+    return ucall(ucopy, dst, (char*)srcva, len);
+
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = copyaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -408,9 +1051,14 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   uint64 n, va0, pa0;
   int got_null = 0;
 
+  // the string can't go past MMAPTOP.
+  n = srcva < MMAPTOP && max > MMAPTOP - srcva ? MMAPTOP - srcva : max;
+  if(direct(pagetable, srcva, n))
+    return ucall(ucopystr, dst, (char*)srcva, n);
+
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = copyaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
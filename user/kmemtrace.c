@@ -0,0 +1,43 @@
+#include "kernel/types.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+// Print the pages the kernel still has allocated, by the
+// kernel address that allocated them and the process they
+// were allocated for, busiest first. Look the addresses up
+// in kernel/kernel.asm. Needs a kernel built with KTRACE=1.
+//
+// usage: kmemtrace [pid]
+
+#define NSITE 256
+
+struct kallocsite sites[NSITE];
+
+int
+main(int argc, char *argv[])
+{
+  struct kallocsite t;
+  int i, j, n, pid = -1, total = 0;
+
+  if(argc > 1)
+    pid = atoi(argv[1]);
+  if((n = kallocsites(pid, sites, NSITE)) < 0){
+    fprintf(2, "kmemtrace: kernel not built with KTRACE=1\n");
+    exit(1);
+  }
+
+  for(i = 1; i < n; i++){
+    t = sites[i];
+    for(j = i; j > 0 && sites[j-1].npages < t.npages; j--)
+      sites[j] = sites[j-1];
+    sites[j] = t;
+  }
+
+  printf("pages\tpid\tcaller\n");
+  for(i = 0; i < n; i++){
+    printf("%d\t%d\t%p\n", sites[i].npages, sites[i].pid, sites[i].pc);
+    total += sites[i].npages;
+  }
+  printf("%d pages from %d sites\n", total, n);
+  exit(0);
+}
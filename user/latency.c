@@ -0,0 +1,66 @@
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// Measure how quickly an interactive process gets the CPU
+// while CPU-bound processes compete for it. The process
+// sleeps for a tick, over and over, and counts the ticks
+// beyond that before it runs again: first at the highest
+// priority, as a process that mostly sleeps keeps, then at
+// the lowest, as if it were just another CPU hog.
+//
+// usage: latency [nspin]
+
+#define NROUND 50
+
+void
+measure(char *what)
+{
+  int i, t, late, total = 0, max = 0;
+
+  for(i = 0; i < NROUND; i++){
+    t = uptime();
+    sleep(1);
+    late = uptime() - t - 1;
+    if(late < 0)
+      late = 0;
+    total += late;
+    if(late > max)
+      max = late;
+  }
+  printf("%s: %d ticks late in %d wakeups, at most %d\n", what, total, NROUND, max);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, nspin = 4, pid[NPROC];
+  volatile int x = 0;
+
+  if(argc > 1)
+    nspin = atoi(argv[1]);
+  if(nspin < 0 || nspin > NPROC/2){
+    fprintf(2, "latency: bad number of spinners\n");
+    exit(1);
+  }
+
+  for(i = 0; i < nspin; i++){
+    if((pid[i] = fork()) < 0){
+      fprintf(2, "latency: fork failed\n");
+      exit(1);
+    }
+    if(pid[i] == 0)
+      for(;;)
+        x++;
+  }
+
+  measure("interactive");
+  nice(NPRIO-1);
+  measure("niced");
+
+  for(i = 0; i < nspin; i++){
+    kill(pid[i]);
+    wait(0);
+  }
+  exit(0);
+}
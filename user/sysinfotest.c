@@ -90,6 +90,115 @@ testcall() {
   }
 }
 
+void
+testalloc() {
+  struct sysinfo info0, info1;
+  char *a;
+
+  sinfo(&info0);
+  a = sbrk(PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("sbrk failed");
+    exit(1);
+  }
+  // touch the page to make sure it's really allocated.
+  a[0] = 1;
+  sinfo(&info1);
+
+  if (info1.allocmem <= info0.allocmem) {
+    printf("FAIL: allocmem %d did not grow from %d\n",
+      info1.allocmem, info0.allocmem);
+    exit(1);
+  }
+  if (info1.freemem + info1.allocmem != info0.freemem + info0.allocmem) {
+    printf("FAIL: free %d + allocated %d != free %d + allocated %d\n",
+      info1.freemem, info1.allocmem, info0.freemem, info0.allocmem);
+    exit(1);
+  }
+  if (info1.peakmem < info1.allocmem) {
+    printf("FAIL: peakmem %d below allocmem %d\n",
+      info1.peakmem, info1.allocmem);
+    exit(1);
+  }
+  sbrk(-PGSIZE);
+}
+
+void
+testzero() {
+  struct sysinfo info0, info1;
+  char *a;
+  int i, sum = 0;
+
+  sinfo(&info0);
+  a = sbrk(10*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("sbrk failed");
+    exit(1);
+  }
+  // reading untouched pages should map the zero page.
+  for(i = 0; i < 10; i++)
+    sum += a[i*PGSIZE];
+  sinfo(&info1);
+  if (sum != 0 || info1.nzeromap != info0.nzeromap + 10) {
+    printf("FAIL: nzeromap %d instead of %d\n",
+      info1.nzeromap, info0.nzeromap + 10);
+    exit(1);
+  }
+  if (info1.allocmem >= info0.allocmem + 10*PGSIZE) {
+    printf("FAIL: reads allocated memory\n");
+    exit(1);
+  }
+
+  // a store gets a private page.
+  a[0] = 1;
+  sinfo(&info1);
+  if (a[0] != 1 || a[PGSIZE] != 0 || info1.nzeromap != info0.nzeromap + 9) {
+    printf("FAIL: nzeromap %d instead of %d after store\n",
+      info1.nzeromap, info0.nzeromap + 9);
+    exit(1);
+  }
+
+  sbrk(-10*PGSIZE);
+  sinfo(&info1);
+  if (info1.nzeromap != info0.nzeromap) {
+    printf("FAIL: nzeromap %d instead of %d after sbrk\n",
+      info1.nzeromap, info0.nzeromap);
+    exit(1);
+  }
+}
+
+// if the kernel traces allocations, pages a process
+// touches show up as its own.
+void
+testtrace() {
+  static struct kallocsite sites[256];
+  int i, n, pid = getpid(), before = 0, after = 0;
+  char *a;
+
+  if((n = kallocsites(pid, sites, 256)) < 0)
+    return;  // kernel built without KTRACE=1
+  for(i = 0; i < n; i++)
+    before += sites[i].npages;
+
+  a = sbrk(10*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("sbrk failed");
+    exit(1);
+  }
+  for(i = 0; i < 10; i++)
+    a[i*PGSIZE] = 1;
+
+  n = kallocsites(pid, sites, 256);
+  for(i = 0; i < n; i++)
+    after += sites[i].npages;
+  if (after < before + 10) {
+    printf("FAIL: kallocsites counts %d pages for pid %d, not %d\n",
+      after, pid, before + 10);
+    exit(1);
+  }
+  sbrk(-10*PGSIZE);
+}
+
 void testproc() {
   struct sysinfo info;
   uint64 nproc;
@@ -126,6 +235,9 @@ main(int argc, char *argv[])
   printf("sysinfotest: start\n");
   testcall();
   testmem();
+  testalloc();
+  testzero();
+  testtrace();
   testproc();
   printf("sysinfotest: OK\n");
   exit(0);
@@ -1,6 +1,7 @@
 struct stat;
 struct rtcdate;
 struct sysinfo;
+struct kallocsite;
 
 // system calls
 int fork(void);
@@ -26,6 +27,14 @@ int sleep(int);
 int uptime(void);
 int trace(int);
 int sysinfo(struct sysinfo *);
+void *mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int kallocsites(int, struct kallocsite*, int);
+int nice(int);
+int usleep(int);
+int waitpid(int, int*, int);
+int clone(void(*)(void*), void*, void*);
+int join(int, int*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -819,6 +820,230 @@ exitwait(char *s)
   }
 }
 
+// waitpid() reaps the child it's asked for, and
+// WNOHANG returns at once if that child is still running.
+void
+waitpidtest(char *s)
+{
+  int pid1, pid2, fds[2], xstate;
+  char c;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid1 = fork();
+  if(pid1 == 0){
+    // wait for the parent to say go.
+    read(fds[0], &c, 1);
+    exit(1);
+  }
+  pid2 = fork();
+  if(pid2 == 0)
+    exit(2);
+  if(pid1 < 0 || pid2 < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+
+  if(waitpid(pid1, &xstate, WNOHANG) != 0){
+    printf("%s: WNOHANG didn't return 0\n", s);
+    exit(1);
+  }
+  if(waitpid(pid2, &xstate, 0) != pid2 || xstate != 2){
+    printf("%s: waitpid(pid2) wrong\n", s);
+    exit(1);
+  }
+  if(waitpid(pid2, &xstate, WNOHANG) != -1){
+    printf("%s: reaped pid2 twice\n", s);
+    exit(1);
+  }
+  if(waitpid(getpid(), 0, WNOHANG) != -1){
+    printf("%s: waitpid of self succeeded\n", s);
+    exit(1);
+  }
+  if(waitpid(-2, 0, 0) != -1 || waitpid(0, 0, 0) != -1){
+    printf("%s: waitpid of a bad pid succeeded\n", s);
+    exit(1);
+  }
+  write(fds[1], "x", 1);
+  if(waitpid(-1, &xstate, 0) != pid1 || xstate != 1){
+    printf("%s: waitpid(-1) wrong\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: children left over\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+#define NTHREAD 4
+
+static volatile int tcount;
+static volatile char *tmem;
+
+void
+threadfn(void *arg)
+{
+  int i;
+
+  for(i = 0; i < 1000; i++)
+    __sync_fetch_and_add(&tcount, 1);
+  // memory one thread grows is there for the rest.
+  if((uint64)arg == 0){
+    tmem = sbrk(PGSIZE);
+    tmem[0] = 'x';
+  }
+  exit(10 + (uint64)arg);
+}
+
+// threads made with clone() share memory, and join() collects them.
+void
+threadtest(char *s)
+{
+  char *stacks[NTHREAD];
+  int tids[NTHREAD], seen[NTHREAD];
+  int i, j, tid, xstate;
+
+  tcount = 0;
+  tmem = 0;
+  for(i = 0; i < NTHREAD; i++){
+    if((stacks[i] = malloc(PGSIZE)) == 0){
+      printf("%s: malloc failed\n", s);
+      exit(1);
+    }
+    tids[i] = clone(threadfn, (void*)(uint64)i, stacks[i] + PGSIZE);
+    if(tids[i] < 0){
+      printf("%s: clone failed\n", s);
+      exit(1);
+    }
+    seen[i] = 0;
+  }
+
+  for(i = 0; i < NTHREAD; i++){
+    tid = join(-1, &xstate);
+    for(j = 0; j < NTHREAD && tids[j] != tid; j++)
+      ;
+    if(j == NTHREAD || seen[j] || xstate != 10 + j){
+      printf("%s: join returned %d status %d\n", s, tid, xstate);
+      exit(1);
+    }
+    seen[j] = 1;
+  }
+  if(join(-1, 0) != -1){
+    printf("%s: join with no threads succeeded\n", s);
+    exit(1);
+  }
+  if(tcount != NTHREAD * 1000){
+    printf("%s: count %d, not %d\n", s, tcount, NTHREAD * 1000);
+    exit(1);
+  }
+  if(tmem == 0 || tmem[0] != 'x'){
+    printf("%s: thread's sbrk() not shared\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NTHREAD; i++)
+    free(stacks[i]);
+}
+
+void
+threadspin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+int tfd;
+
+void
+threadfdfn(void *arg)
+{
+  // open first, so that tfd can't reuse the closed fd.
+  tfd = open("tfdfile", O_CREATE|O_RDWR);
+  close((uint64)arg);
+  if(tfd < 0 || mkdir("tfddir") < 0 || chdir("tfddir") < 0)
+    exit(1);
+  exit(0);
+}
+
+// a thread's open(), close() and chdir() are seen by the
+// other threads of its process.
+void
+threadfdtest(char *s)
+{
+  int fds[2], xstate;
+  char *stack;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if((stack = malloc(PGSIZE)) == 0 ||
+     clone(threadfdfn, (void*)(uint64)fds[1], stack + PGSIZE) < 0){
+    printf("%s: clone failed\n", s);
+    exit(1);
+  }
+  if(join(-1, &xstate) < 0 || xstate != 0){
+    printf("%s: thread failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "x", 1) != -1){
+    printf("%s: thread's close() not shared\n", s);
+    exit(1);
+  }
+  if(write(tfd, "x", 1) != 1){
+    printf("%s: thread's open() not shared\n", s);
+    exit(1);
+  }
+  close(tfd);
+  close(fds[0]);
+  if(open("tfdfile", O_RDONLY) >= 0 || chdir("..") < 0){
+    printf("%s: thread's chdir() not shared\n", s);
+    exit(1);
+  }
+  unlink("tfdfile");
+  unlink("tfddir");
+  free(stack);
+}
+
+// killing a process, or its leader exiting, ends all its threads.
+void
+threadkilltest(char *s)
+{
+  int pid, i, xstate;
+  char *stack;
+
+  for(i = 0; i < 2; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      if((stack = malloc(PGSIZE)) == 0 ||
+         clone(threadspin, 0, stack + PGSIZE) < 0 ||
+         clone(threadspin, 0, stack + PGSIZE/2) < 0){
+        printf("%s: clone failed\n", s);
+        exit(1);
+      }
+      if(i == 1)
+        exit(7);
+      for(;;)
+        ;
+    }
+    if(i == 0){
+      sleep(1);
+      kill(pid);
+    }
+    if(wait(&xstate) != pid || xstate != (i == 0 ? -1 : 7)){
+      printf("%s: wait wrong\n", s);
+      exit(1);
+    }
+  }
+}
+
 // try to find races in the reparenting
 // code that handles a parent exiting
 // when it still has live children.
@@ -1006,6 +1231,311 @@ mem(char *s)
   }
 }
 
+// fork shares memory copy-on-write. do the parent and
+// children each see only their own stores, including
+// stores made by the kernel on read()?
+void
+cowfork(char *s)
+{
+  enum { SZ = 256*PGSIZE, NCHILD = 3 };
+  char *a;
+  int fds[2];
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < SZ; i += PGSIZE)
+    a[i] = 'p';
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  for(int c = 0; c < NCHILD; c++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int i = 0; i < SZ; i += PGSIZE)
+        a[i] = '0' + c;
+      if(write(fds[1], "x", 1) != 1 || read(fds[0], a + PGSIZE + 1, 1) != 1)
+        exit(1);
+      for(int i = 0; i < SZ; i += PGSIZE)
+        if(a[i] != '0' + c)
+          exit(1);
+      exit(a[PGSIZE + 1] == 'x' ? 0 : 1);
+    }
+  }
+
+  for(int c = 0; c < NCHILD; c++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: child saw wrong data\n", s);
+      exit(1);
+    }
+  }
+  for(int i = 0; i < SZ; i += PGSIZE){
+    if(a[i] != 'p'){
+      printf("%s: parent's memory changed at %d\n", s, i);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// sbrk() only reserves memory. are untouched pages allocated on
+// first use, including when the kernel reads or writes them for
+// a system call, and in a fork child?
+void
+lazysbrk(char *s)
+{
+  enum { SZ = 16*1024*1024 };
+  char *a, buf[4];
+  int fds[2];
+
+  a = sbrk(SZ);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  a[SZ/2] = 2;
+  a[SZ-1] = 3;
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  // the kernel writes into an untouched page.
+  if(write(fds[1], "lazy", 4) != 4 || read(fds[0], a + 5*PGSIZE, 4) != 4 ||
+     memcmp(a + 5*PGSIZE, "lazy", 4) != 0){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  // the kernel reads from an untouched page, which must be zero.
+  if(write(fds[1], a + 9*PGSIZE, 4) != 4 || read(fds[0], buf, 4) != 4 ||
+     buf[0] || buf[1] || buf[2] || buf[3]){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[SZ/4] = 4;
+    exit(a[0] == 1 && a[SZ/2] == 2 && a[SZ-1] == 3 && a[SZ/4] == 4 &&
+         a[SZ/8] == 0 ? 0 : 1);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child saw wrong data\n", s);
+    exit(1);
+  }
+  if(a[SZ/4] != 0){
+    printf("%s: child's store visible in parent\n", s);
+    exit(1);
+  }
+  sbrk(-SZ);
+  exit(0);
+}
+
+// map a file 2.5 pages long, privately and shared. are the
+// contents right, including the zeroed tail? do private
+// stores stay out of the file, and shared ones reach it?
+void
+mmapfile(char *s)
+{
+  enum { SZ = 2*PGSIZE + PGSIZE/2 };
+  static char buf[SZ], buf2[SZ+1];
+  char *a;
+  int fd, i;
+
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED){
+    printf("%s: shared writable mapping of read-only file\n", s);
+    exit(1);
+  }
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(a == MAP_FAILED){
+    printf("%s: private mmap failed\n", s);
+    exit(1);
+  }
+  if(memcmp(a, buf, SZ) != 0 || a[SZ] != 0 || a[3*PGSIZE-1] != 0){
+    printf("%s: wrong contents\n", s);
+    exit(1);
+  }
+  a[0] = 'X';
+  if(munmap(a, 3*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  fd = open("mmapfile", O_RDWR);
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(a == MAP_FAILED){
+    printf("%s: shared mmap failed\n", s);
+    exit(1);
+  }
+  a[0] = 'Y';
+  a[PGSIZE] = 'Z';
+  a[SZ] = 'W';       // past the end of the file
+  // unmap the pages one at a time, the middle one first.
+  if(munmap(a + PGSIZE, PGSIZE) < 0 || munmap(a, PGSIZE) < 0 ||
+     munmap(a + 2*PGSIZE, PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf2, SZ+1) != SZ){
+    printf("%s: file changed size\n", s);
+    exit(1);
+  }
+  close(fd);
+  buf[0] = 'Y';
+  buf[PGSIZE] = 'Z';
+  if(memcmp(buf, buf2, SZ) != 0){
+    printf("%s: shared stores not written back\n", s);
+    exit(1);
+  }
+  unlink("mmapfile");
+  exit(0);
+}
+
+// anonymous mappings: shared ones stay shared with a fork
+// child, private ones don't, and unmapped ones are gone.
+void
+mmapanon(char *s)
+{
+  char *sh, *pr;
+  int pid, xstatus;
+
+  sh = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  pr = mmap(0, 2*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(sh == MAP_FAILED || pr == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(sh[0] != 0 || pr[PGSIZE] != 0){
+    printf("%s: not zeroed\n", s);
+    exit(1);
+  }
+  pr[0] = 1;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sh[PGSIZE] = 7;
+    pr[0] = 2;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || sh[PGSIZE] != 7){
+    printf("%s: shared store not seen by parent\n", s);
+    exit(1);
+  }
+  if(pr[0] != 1){
+    printf("%s: private store seen by parent\n", s);
+    exit(1);
+  }
+
+  if(munmap(sh, 2*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0){
+    sh[0] = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: store to unmapped memory succeeded\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// touch more pages than there is free memory, so that some
+// must go to the swap area, and check that they come back
+// intact, in this process and in a child that shares them.
+void
+swapmem(char *s)
+{
+  struct sysinfo info;
+  char *start, *a;
+  uint64 i, n;
+  int pid, xstatus;
+
+  if(sysinfo(&info) < 0){
+    printf("%s: sysinfo failed\n", s);
+    exit(1);
+  }
+  n = info.freemem / PGSIZE + 64;
+
+  start = sbrk(0);
+  for(i = 0; i < n; i++){
+    a = sbrk(PGSIZE);
+    if(a == (char*)-1){
+      printf("%s: sbrk failed after %d of %d pages\n", s, (int)i, (int)n);
+      exit(1);
+    }
+    *(uint64*)a = i;
+  }
+
+  // leave room for fork() to make page tables.
+  sbrk(-128*PGSIZE);
+  n -= 128;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(*(uint64*)(start + i*PGSIZE) != i){
+      printf("%s: page %d lost in %s\n", s, (int)i, pid ? "parent" : "child");
+      exit(1);
+    }
+  }
+  if(pid == 0)
+    exit(0);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  exit(0);
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -2348,8 +2878,9 @@ stacktest(char *s)
   
   pid = fork();
   if(pid == 0) {
-    char *sp = (char *) r_sp();
-    sp -= PGSIZE;
+    // the stack can grow to USTACKSIZE pages.
+    char *sp = (char *) PGROUNDDOWN(r_sp());
+    sp -= USTACKSIZE*PGSIZE;
     // the *sp should cause a trap.
     printf("%s: stacktest: read below stack %p\n", *sp);
     exit(1);
@@ -2364,6 +2895,113 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// the kernel mustn't copy to or from the guard page either.
+void
+stackguardcopy(char *s)
+{
+  char *guard = (char *) PGROUNDDOWN(r_sp()) - USTACKSIZE*PGSIZE;
+  int fds[2];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], guard, 8) != -1){
+    printf("%s: write from guard page succeeded\n", s);
+    exit(1);
+  }
+  write(fds[1], "xxxxxxxx", 8);
+  if(read(fds[0], guard, 8) != -1){
+    printf("%s: read into guard page succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static int
+stackdepth(int n)
+{
+  volatile char buf[1024];
+  int i, sum;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = n;
+  sum = n > 0 ? stackdepth(n - 1) : 0;
+  for(i = 0; i < sizeof(buf); i++)
+    sum += buf[i] == (char)n;
+  return sum;
+}
+
+// the user stack grows on demand well past one page.
+void
+stackgrow(char *s)
+{
+  int n = (USTACKSIZE / 2) * (PGSIZE / 1024);
+
+  if(stackdepth(n) != (n + 1) * 1024){
+    printf("%s: stack corrupted\n", s);
+    exit(1);
+  }
+}
+
+// nice() sets the level a process returns to, and
+// fork() passes it on.
+void
+nicetest(char *s)
+{
+  int pid, xstatus;
+
+  if(nice(1) != 0 || nice(NPRIO-1) != 1 || nice(NPRIO) != -1 || nice(-1) != -1){
+    printf("%s: nice levels wrong\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(nice(0) != NPRIO-1);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child didn't inherit nice level\n", s);
+    exit(1);
+  }
+  nice(0);
+}
+
+// usleep() sleeps for less than a tick, and sleep() for
+// whole ticks.
+void
+usleeptest(char *s)
+{
+  int i, t;
+
+  if(usleep(-1) != -1){
+    printf("%s: usleep(-1) succeeded\n", s);
+    exit(1);
+  }
+  t = uptime();
+  for(i = 0; i < 20; i++){
+    if(usleep(1000) != 0){
+      printf("%s: usleep failed\n", s);
+      exit(1);
+    }
+  }
+  // 20ms is a fraction of a tick; allow for a busy machine.
+  if(uptime() - t > 5){
+    printf("%s: usleep(1000) took too long\n", s);
+    exit(1);
+  }
+  t = uptime();
+  sleep(2);
+  if(uptime() - t < 2){
+    printf("%s: sleep(2) returned early\n", s);
+    exit(1);
+  }
+}
+
 // regression test. copyin(), copyout(), and copyinstr() used to cast
 // the virtual page address to uint, which (with certain wild system
 // call arguments) resulted in a kernel page faults.
@@ -2676,6 +3314,10 @@ main(int argc, char *argv[])
     {sbrkarg, "sbrkarg"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
+    {stackguardcopy, "stackguardcopy"},
+    {stackgrow, "stackgrow"},
+    {nicetest, "nicetest"},
+    {usleeptest, "usleeptest"},
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
@@ -2684,9 +3326,18 @@ main(int argc, char *argv[])
     {exitiputtest, "exitiput"},
     {iputtest, "iput"},
     {mem, "mem"},
+    {cowfork, "cowfork"},
+    {lazysbrk, "lazysbrk"},
+    {mmapfile, "mmapfile"},
+    {mmapanon, "mmapanon"},
+    {swapmem, "swapmem"},
     {pipe1, "pipe1"},
     {preempt, "preempt"},
     {exitwait, "exitwait"},
+    {waitpidtest, "waitpidtest"},
+    {threadtest, "threadtest"},
+    {threadkilltest, "threadkilltest"},
+    {threadfdtest, "threadfdtest"},
     {rmdot, "rmdot"},
     {fourteen, "fourteen"},
     {bigfile, "bigfile"},
@@ -37,4 +37,12 @@ entry("sbrk");
 entry("sleep");
 entry("uptime");
 entry("trace");
-entry("sysinfo");
\ No newline at end of file
+entry("sysinfo");
+entry("mmap");
+entry("munmap");
+entry("kallocsites");
+entry("nice");
+entry("usleep");
+entry("waitpid");
+entry("clone");
+entry("join");
\ No newline at end of file